@@ -1,43 +1,844 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include "structmember.h"
 #include "tinyexpr.h"
 
 
+static PyObject *aparseError;
+
+/* Variables every expression is compiled with unless told otherwise. */
+static PyObject *default_names;
+
+
+/* A compiled expression together with the slots its variables are bound to. */
+typedef struct {
+    PyObject_HEAD
+    te_expr *expr;
+    PyObject *text;         /* The expression source. */
+    PyObject *names;        /* Tuple of variable names, parallel to slots. */
+    int count;
+    te_variable *vars;
+    Rational *slots;
+    PyThread_type_lock lock; /* Held while the slots are written and evaluated. */
+} ExpressionObject;
+
+static PyTypeObject ExpressionType;
+
+
+static ExpressionObject *
+expression_create(PyObject *text, PyObject *names)
+{
+    ExpressionObject *self;
+    const char *source;
+    int err, i;
+
+    source = PyUnicode_AsUTF8(text);
+    if (source == NULL)
+        return NULL;
+
+    self = PyObject_New(ExpressionObject, &ExpressionType);
+    if (self == NULL)
+        return NULL;
+    self->expr = NULL;
+    self->lock = NULL;
+    self->count = (int)PyTuple_GET_SIZE(names);
+    self->vars = PyMem_Calloc(self->count ? self->count : 1, sizeof(te_variable));
+    self->slots = PyMem_Calloc(self->count ? self->count : 1, sizeof(Rational));
+    Py_INCREF(text);
+    self->text = text;
+    Py_INCREF(names);
+    self->names = names;
+    self->lock = PyThread_allocate_lock();
+    if (self->vars == NULL || self->slots == NULL || self->lock == NULL) {
+        Py_DECREF(self);
+        return (ExpressionObject *)PyErr_NoMemory();
+    }
+
+    for (i = 0; i < self->count; i++) {
+        PyObject *name = PyTuple_GET_ITEM(names, i);
+        if (!PyUnicode_Check(name)) {
+            PyErr_SetString(PyExc_TypeError, "variable names must be strings");
+            Py_DECREF(self);
+            return NULL;
+        }
+        /* The UTF-8 buffer lives as long as the names tuple we hold. */
+        self->vars[i].name = PyUnicode_AsUTF8(name);
+        if (self->vars[i].name == NULL) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->vars[i].address = &self->slots[i];
+        self->slots[i].numerator = 0;
+        self->slots[i].denominator = 1;
+    }
+
+    /* Compiling only touches memory this object owns. */
+    Py_BEGIN_ALLOW_THREADS
+    self->expr = te_compile_arena(source, self->vars, self->count, &err);
+    Py_END_ALLOW_THREADS
+    if (self->expr == NULL) {
+        PyErr_Format(aparseError, "syntax error near position %d", err);
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+static void
+expression_dealloc(ExpressionObject *self)
+{
+    te_free(self->expr);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    PyMem_Free(self->vars);
+    PyMem_Free(self->slots);
+    Py_XDECREF(self->text);
+    Py_XDECREF(self->names);
+    PyObject_Del(self);
+}
+
+
+/* Stores num/den in lowest terms with a positive denominator, as the core
+ * arithmetic expects. */
+static int
+set_ratio(long long num, long long den, Rational *out)
+{
+    unsigned long long n = num < 0 ? 0ULL - (unsigned long long)num : (unsigned long long)num;
+    unsigned long long d = den < 0 ? 0ULL - (unsigned long long)den : (unsigned long long)den;
+    unsigned long long a = n, b = d, t;
+    const int negative = (num < 0) != (den < 0);
+
+    if (den == 0) {
+        PyErr_SetString(PyExc_ZeroDivisionError, "denominator is zero");
+        return -1;
+    }
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    n /= a;
+    d /= a;
+    if (d > LLONG_MAX || n > (negative ? 0ULL - (unsigned long long)LLONG_MIN : (unsigned long long)LLONG_MAX)) {
+        PyErr_SetString(PyExc_OverflowError, "value does not fit in 64 bits");
+        return -1;
+    }
+    out->numerator = negative ? (long long)(0ULL - n) : (long long)n;
+    out->denominator = (long long)d;
+    return 0;
+}
+
+/* Accepts ints, Fractions, and anything with as_integer_ratio (float, Decimal). */
+static int
+to_rational(PyObject *value, Rational *out)
+{
+    PyObject *num, *den;
+    long long n, d;
+    int overflow;
+
+    if (PyLong_Check(value)) {
+        out->numerator = PyLong_AsLongLongAndOverflow(value, &overflow);
+        out->denominator = 1;
+        if (overflow) {
+            PyErr_SetString(PyExc_OverflowError, "value does not fit in 64 bits");
+            return -1;
+        }
+        return out->numerator == -1 && PyErr_Occurred() ? -1 : 0;
+    }
+
+    if (PyObject_HasAttrString(value, "numerator") && PyObject_HasAttrString(value, "denominator")) {
+        num = PyObject_GetAttrString(value, "numerator");
+        den = PyObject_GetAttrString(value, "denominator");
+    } else {
+        PyObject *ratio = PyObject_CallMethod(value, "as_integer_ratio", NULL);
+        if (ratio == NULL) {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError, "cannot use %.100s as a rational", Py_TYPE(value)->tp_name);
+            return -1;
+        }
+        if (!PyArg_ParseTuple(ratio, "OO", &num, &den)) {
+            Py_DECREF(ratio);
+            return -1;
+        }
+        Py_INCREF(num);
+        Py_INCREF(den);
+        Py_DECREF(ratio);
+    }
+
+    if (num == NULL || den == NULL) {
+        Py_XDECREF(num);
+        Py_XDECREF(den);
+        return -1;
+    }
+    n = PyLong_AsLongLong(num);
+    d = PyLong_AsLongLong(den);
+    Py_DECREF(num);
+    Py_DECREF(den);
+    if (PyErr_Occurred())
+        return -1;
+    return set_ratio(n, d, out);
+}
+
+
+/* Text of one result. Filled in without the GIL, so spills use the raw allocator. */
+typedef struct {
+    char local[128];
+    char *text;
+    int status;             /* 0, or one of the RESULT_ codes below. */
+} result_buf;
+
+enum {RESULT_SYNTAX = 1, RESULT_NO_MEMORY};
+
+/* Evaluates with arbitrary precision and formats "num/den" into out. */
+static void
+format_big(const te_expr *n, result_buf *out)
+{
+    te_big r = te_eval_big(n);
+    int len = te_big_format(&r, out->local, sizeof(out->local));
+
+    out->text = out->local;
+    out->status = 0;
+    if (len < 0) {
+        out->status = RESULT_NO_MEMORY;
+    } else if (len >= (int)sizeof(out->local)) {
+        out->text = PyMem_RawMalloc(len + 1);
+        if (out->text == NULL) {
+            out->text = out->local;
+            out->status = RESULT_NO_MEMORY;
+        } else {
+            te_big_format(&r, out->text, len + 1);
+        }
+    }
+    te_big_free(&r);
+}
+
+/* Binds values to the handle's slots and evaluates it. Called without the GIL. */
+static void
+expression_run(ExpressionObject *e, const Rational *values, result_buf *out)
+{
+    int i;
+
+    PyThread_acquire_lock(e->lock, WAIT_LOCK);
+    for (i = 0; i < e->count; i++)
+        e->slots[i] = values[i];
+    format_big(e->expr, out);
+    PyThread_release_lock(e->lock);
+}
+
+/* Turns a finished result into a str, or sets an exception. Frees out. */
+static PyObject *
+result_object(result_buf *out)
+{
+    PyObject *ret = NULL;
+
+    switch (out->status) {
+    case 0: ret = PyUnicode_FromString(out->text); break;
+    case RESULT_SYNTAX: PyErr_SetString(aparseError, "syntax error"); break;
+    default: PyErr_NoMemory(); break;
+    }
+    if (out->text != out->local)
+        PyMem_RawFree(out->text);
+    return ret;
+}
+
+/* Evaluates a handle with the GIL released. */
+static PyObject *
+expression_call(ExpressionObject *e, const Rational *values)
+{
+    result_buf out;
+
+    Py_BEGIN_ALLOW_THREADS
+    expression_run(e, values, &out);
+    Py_END_ALLOW_THREADS
+    return result_object(&out);
+}
+
+
+static PyObject *
+expression_eval(ExpressionObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *key, *value, *ret = NULL;
+    Py_ssize_t pos = 0;
+    Rational *values;
+    int i;
+
+    if (PyTuple_GET_SIZE(args) != 0) {
+        PyErr_SetString(PyExc_TypeError, "eval() takes variables as keyword arguments only");
+        return NULL;
+    }
+
+    values = PyMem_Malloc((self->count ? self->count : 1) * sizeof(Rational));
+    if (values == NULL)
+        return PyErr_NoMemory();
+
+    /* Variables that are not given evaluate as 0. */
+    for (i = 0; i < self->count; i++) {
+        values[i].numerator = 0;
+        values[i].denominator = 1;
+    }
+
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        for (i = 0; i < self->count; i++) {
+            if (PyUnicode_Compare(key, PyTuple_GET_ITEM(self->names, i)) == 0)
+                break;
+        }
+        if (i == self->count) {
+            PyErr_Format(PyExc_TypeError, "unknown variable '%U'", key);
+            goto done;
+        }
+        if (to_rational(value, &values[i]) < 0)
+            goto done;
+    }
+
+    ret = expression_call(self, values);
+done:
+    PyMem_Free(values);
+    return ret;
+}
+
+/* Views obj as a contiguous one-dimensional int64 buffer of exactly rows items
+ * (any length if rows < 0). Returns -1 with an exception set. */
+static int
+int64_view(PyObject *obj, Py_buffer *view, int writable, Py_ssize_t rows, const char *what)
+{
+    const char *fmt;
+
+    if (PyObject_GetBuffer(obj, view, PyBUF_ND | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0)) < 0)
+        return -1;
+    fmt = view->format;
+    if (fmt != NULL && (*fmt == '@' || *fmt == '='))
+        fmt++;
+    if (view->ndim != 1 || view->itemsize != 8 || fmt == NULL || (strcmp(fmt, "q") != 0 && strcmp(fmt, "l") != 0)) {
+        PyErr_Format(PyExc_TypeError, "%s must be a one-dimensional int64 buffer", what);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    if (rows >= 0 && view->shape[0] != rows) {
+        PyErr_Format(PyExc_ValueError, "%s has %zd items, expected %zd", what, view->shape[0], rows);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+expression_eval_buffers(ExpressionObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *out_num, *out_den = Py_None, *key, *value, *ret = NULL;
+    Py_ssize_t pos = 0, rows;
+    Py_buffer *views;
+    te_column *columns;
+    Rational *values;
+    int i, nviews = 0, err = 0;
+
+    if (!PyArg_ParseTuple(args, "O|O:eval_buffers", &out_num, &out_den))
+        return NULL;
+    /* out_denominator may also come by keyword; every other keyword is a variable. */
+    if (kwargs && (value = PyDict_GetItemString(kwargs, "out_denominator")) != NULL) {
+        if (PyTuple_GET_SIZE(args) > 1) {
+            PyErr_SetString(PyExc_TypeError, "eval_buffers() got multiple values for argument 'out_denominator'");
+            return NULL;
+        }
+        out_den = value;
+    }
+
+    /* Room for the two outputs plus a numerator and denominator per variable. */
+    views = PyMem_Calloc(2 * self->count + 2, sizeof(Py_buffer));
+    columns = PyMem_Calloc(self->count ? self->count : 1, sizeof(te_column));
+    values = PyMem_Calloc(self->count ? self->count : 1, sizeof(Rational));
+    if (views == NULL || columns == NULL || values == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    if (int64_view(out_num, &views[nviews], 1, -1, "out_numerator") < 0)
+        goto done;
+    rows = views[nviews++].shape[0];
+    if (rows > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "too many rows");
+        goto done;
+    }
+    if (out_den != Py_None) {
+        if (int64_view(out_den, &views[nviews++], 1, rows, "out_denominator") < 0) {
+            nviews--;
+            goto done;
+        }
+    }
+
+    for (i = 0; i < self->count; i++) {
+        values[i].numerator = 0;
+        values[i].denominator = 1;
+    }
+
+    /* A variable is a numerator buffer, a (numerator, denominator) pair of
+     * buffers, or a single value used for every row. */
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        if (PyUnicode_CompareWithASCIIString(key, "out_denominator") == 0)
+            continue;
+        for (i = 0; i < self->count; i++) {
+            if (PyUnicode_Compare(key, PyTuple_GET_ITEM(self->names, i)) == 0)
+                break;
+        }
+        if (i == self->count) {
+            PyErr_Format(PyExc_TypeError, "unknown variable '%U'", key);
+            goto done;
+        }
+        if (PyTuple_Check(value) && PyTuple_GET_SIZE(value) == 2) {
+            if (int64_view(PyTuple_GET_ITEM(value, 0), &views[nviews], 0, rows, "numerator column") < 0)
+                goto done;
+            columns[i].numerator = views[nviews++].buf;
+            if (int64_view(PyTuple_GET_ITEM(value, 1), &views[nviews], 0, rows, "denominator column") < 0)
+                goto done;
+            columns[i].denominator = views[nviews++].buf;
+        } else if (PyObject_CheckBuffer(value)) {
+            if (int64_view(value, &views[nviews], 0, rows, "variable column") < 0)
+                goto done;
+            columns[i].numerator = views[nviews++].buf;
+        } else if (to_rational(value, &values[i]) < 0) {
+            goto done;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    for (i = 0; i < self->count; i++)
+        self->slots[i] = values[i];
+    err = te_eval_batch(self->expr, self->vars, columns, self->count, (int)rows,
+                        views[0].buf, out_den != Py_None ? views[1].buf : NULL);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+
+    if (err < 0) {
+        PyErr_NoMemory();
+    } else {
+        ret = Py_None;
+        Py_INCREF(ret);
+    }
+
+done:
+    while (nviews > 0)
+        PyBuffer_Release(&views[--nviews]);
+    PyMem_Free(views);
+    PyMem_Free(columns);
+    PyMem_Free(values);
+    return ret;
+}
+
+static PyObject *
+expression_repr(ExpressionObject *self)
+{
+    return PyUnicode_FromFormat("aparse.Expression(%R)", self->text);
+}
+
+static PyMethodDef expression_methods[] = {
+    {"eval", (PyCFunction)(void (*)(void))expression_eval, METH_VARARGS | METH_KEYWORDS,
+     "eval(**variables) -> 'numerator/denominator'\n\n"
+     "Evaluates the compiled expression. Variables may be ints, Fractions\n"
+     "or floats; any that are not given are 0."},
+    {"eval_buffers", (PyCFunction)(void (*)(void))expression_eval_buffers, METH_VARARGS | METH_KEYWORDS,
+     "eval_buffers(out_numerator, out_denominator=None, **variables)\n\n"
+     "Evaluates once per row of out_numerator, writing results in place.\n"
+     "All buffers are one-dimensional int64 (e.g. numpy.int64 arrays) of the\n"
+     "same length. A variable is a numerator buffer, a (numerator, denominator)\n"
+     "pair of buffers, or a single value shared by every row. Rows that do not\n"
+     "fit in 64 bits get a denominator of 0. out_denominator may be passed by\n"
+     "keyword, so no variable can be named out_denominator."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef expression_members[] = {
+    {"expression", T_OBJECT, offsetof(ExpressionObject, text), READONLY, "The expression source."},
+    {"variables", T_OBJECT, offsetof(ExpressionObject, names), READONLY, "Names the expression may use."},
+    {NULL}
+};
+
+static PyTypeObject ExpressionType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "aparse.Expression",                /* tp_name */
+    sizeof(ExpressionObject),           /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)expression_dealloc,     /* tp_dealloc */
+    0,                                  /* tp_print / tp_vectorcall_offset */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_as_async */
+    (reprfunc)expression_repr,          /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    "Compiled expression returned by aparse.compile().", /* tp_doc */
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    expression_methods,                 /* tp_methods */
+    expression_members,                 /* tp_members */
+};
+
+
+/* LRU cache of compiled expressions. Dicts keep insertion order, so a hit is
+ * moved to the end by re-inserting it and the oldest entry is always first. */
+static PyObject *cache;
+static Py_ssize_t cache_size = 1024;
+static unsigned long long cache_hits, cache_misses;
+
+static ExpressionObject *
+cache_get(PyObject *text, PyObject *names)
+{
+    ExpressionObject *entry;
+    PyObject *key;
+
+    if (names == default_names) {
+        key = text;
+        Py_INCREF(key);
+    } else {
+        key = PyTuple_Pack(2, text, names);
+        if (key == NULL)
+            return NULL;
+    }
+
+    entry = (ExpressionObject *)PyDict_GetItemWithError(cache, key);
+    if (entry != NULL) {
+        cache_hits++;
+        Py_INCREF(entry);
+        if (PyDict_DelItem(cache, key) < 0 || PyDict_SetItem(cache, key, (PyObject *)entry) < 0) {
+            Py_CLEAR(entry);
+        }
+        Py_DECREF(key);
+        return entry;
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    cache_misses++;
+    entry = expression_create(text, names);
+    if (entry != NULL && cache_size > 0) {
+        while (PyDict_GET_SIZE(cache) >= cache_size) {
+            PyObject *oldest, *value;
+            Py_ssize_t pos = 0;
+            if (!PyDict_Next(cache, &pos, &oldest, &value))
+                break;
+            Py_INCREF(oldest);
+            if (PyDict_DelItem(cache, oldest) < 0) {
+                Py_DECREF(oldest);
+                Py_CLEAR(entry);
+                break;
+            }
+            Py_DECREF(oldest);
+        }
+        if (entry != NULL && PyDict_SetItem(cache, key, (PyObject *)entry) < 0)
+            Py_CLEAR(entry);
+    }
+    Py_DECREF(key);
+    return entry;
+}
+
+
+/* parser() always evaluates with x = 3, y = 4. */
+static const Rational parser_values[2] = {{3, 1}, {4, 1}};
+
 static PyObject *
 aparse_parser(PyObject *self, PyObject *args)
 {
-    const char *expression;
-    int sts;
+    PyObject *text, *ret;
+    ExpressionObject *e;
 
-    if (!PyArg_ParseTuple(args, "s", &expression))
+    if (!PyArg_ParseTuple(args, "U", &text))
         return NULL;
-	double x, y;
-    te_variable vars[] = {{"x", &x}, {"y", &y}};
 
-    /* This will compile the expression and check for errors. */
+    e = cache_get(text, default_names);
+    if (e == NULL)
+        return NULL;
+
+    ret = expression_call(e, parser_values);
+    Py_DECREF(e);
+    return ret;
+}
+
+static PyObject *
+aparse_compile(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"expression", "variables", NULL};
+    PyObject *text, *variables = NULL, *names, *ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|O:compile", keywords, &text, &variables))
+        return NULL;
+
+    if (variables == NULL || variables == Py_None) {
+        names = default_names;
+        Py_INCREF(names);
+    } else {
+        names = PySequence_Tuple(variables);
+        if (names == NULL)
+            return NULL;
+    }
+
+    ret = (PyObject *)cache_get(text, names);
+    Py_DECREF(names);
+    return ret;
+}
+
+/* One parse_many() entry. handle is a cached compile, or NULL to compile source. */
+typedef struct {
+    const char *source;
+    ExpressionObject *handle;
+    result_buf out;
+} job;
+
+/* Work shared by the parse_many() threads; next and running are guarded by lock. */
+typedef struct {
+    job *jobs;
+    Py_ssize_t count, next;
+    int running;
+    PyThread_type_lock lock;
+    PyThread_type_lock finished;   /* Held until the last worker exits. */
+} pool;
+
+static void
+run_job(job *j)
+{
+    Rational x = parser_values[0], y = parser_values[1];
+    te_variable vars[] = {{"x", &x}, {"y", &y}};
+    te_expr *n;
     int err;
-    te_expr *n = te_compile(expression, vars, 2, &err);
-	Rational r;
-    if (n) {
-        /* The variables can be changed here, and eval can be called as many
-         * times as you like. This is fairly efficient because the parsing has
-         * already been done. */
-        x = 3; y = 4;
-         r = te_eval(n);
-
-        te_free(n);
+
+    if (j->handle != NULL) {
+        expression_run(j->handle, parser_values, &j->out);
+        return;
+    }
+
+    n = te_compile_arena(j->source, vars, 2, &err);
+    if (n == NULL) {
+        j->out.text = j->out.local;
+        j->out.status = RESULT_SYNTAX;
+        return;
+    }
+    format_big(n, &j->out);
+    te_free(n);
+}
+
+/* Pulls jobs until none are left. Runs without the GIL and never touches Python objects. */
+static void
+pool_worker(void *arg)
+{
+    pool *p = arg;
+    Py_ssize_t i;
+    int last;
+
+    for (;;) {
+        PyThread_acquire_lock(p->lock, WAIT_LOCK);
+        i = p->next < p->count ? p->next++ : -1;
+        last = i < 0 && --p->running == 0;
+        PyThread_release_lock(p->lock);
+        if (i >= 0) {
+            run_job(&p->jobs[i]);
+            continue;
+        }
+        /* p may be gone as soon as finished is released. */
+        if (last)
+            PyThread_release_lock(p->finished);
+        return;
+    }
+}
+
+static PyObject *
+aparse_parse_many(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"expressions", "threads", NULL};
+    PyObject *list, *texts, *ret = NULL;
+    Py_ssize_t threads = 0, i, count;
+    pool p;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n:parse_many", keywords, &list, &threads))
+        return NULL;
+    if (threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "threads must be >= 0");
+        return NULL;
+    }
+
+    texts = PySequence_Tuple(list);
+    if (texts == NULL)
+        return NULL;
+    count = PyTuple_GET_SIZE(texts);
+
+    memset(&p, 0, sizeof(p));
+    p.count = count;
+    p.jobs = PyMem_Calloc(count ? count : 1, sizeof(job));
+    p.lock = PyThread_allocate_lock();
+    p.finished = PyThread_allocate_lock();
+    if (p.jobs == NULL || p.lock == NULL || p.finished == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* Cached entries are evaluated through their handle; the rest are compiled
+     * by the workers and not added to the cache. */
+    for (i = 0; i < count; i++) {
+        PyObject *text = PyTuple_GET_ITEM(texts, i), *entry;
+        if (!PyUnicode_Check(text)) {
+            PyErr_SetString(PyExc_TypeError, "parse_many() expects a sequence of str");
+            goto done;
+        }
+        p.jobs[i].source = PyUnicode_AsUTF8(text);
+        if (p.jobs[i].source == NULL)
+            goto done;
+        entry = PyDict_GetItemWithError(cache, text);
+        if (entry == NULL && PyErr_Occurred())
+            goto done;
+        Py_XINCREF(entry);
+        p.jobs[i].handle = (ExpressionObject *)entry;
+    }
+
+    if (threads == 0) {
+        PyObject *os = PyImport_ImportModule("os");
+        PyObject *cpus = os ? PyObject_CallMethod(os, "cpu_count", NULL) : NULL;
+        Py_XDECREF(os);
+        threads = cpus != NULL && cpus != Py_None ? PyLong_AsSsize_t(cpus) : 1;
+        Py_XDECREF(cpus);
+        PyErr_Clear();
+        if (threads < 1)
+            threads = 1;
+    }
+    if (threads > count)
+        threads = count;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (threads <= 1) {
+        for (i = 0; i < count; i++)
+            run_job(&p.jobs[i]);
     } else {
-        /* Show the user where the error is at. */
-       // printf("\t%*s^\nError near here", err-1, "");
-    }	
-	sprintf(expression,("%lld/%lld"),r.numerator,r.denominator);
-    return PyUnicode_FromString(expression);
+        PyThread_acquire_lock(p.finished, WAIT_LOCK);
+        /* The calling thread works too, so it starts one fewer. */
+        p.running = 1;
+        for (i = 1; i < threads; i++) {
+            PyThread_acquire_lock(p.lock, WAIT_LOCK);
+            p.running++;
+            PyThread_release_lock(p.lock);
+            if (PyThread_start_new_thread(pool_worker, &p) == PYTHREAD_INVALID_THREAD_ID) {
+                PyThread_acquire_lock(p.lock, WAIT_LOCK);
+                p.running--;
+                PyThread_release_lock(p.lock);
+                break;
+            }
+        }
+        pool_worker(&p);
+        PyThread_acquire_lock(p.finished, WAIT_LOCK);
+        PyThread_release_lock(p.finished);
+    }
+    Py_END_ALLOW_THREADS
+
+    ret = PyList_New(count);
+    for (i = 0; i < count; i++) {
+        job *j = &p.jobs[i];
+        PyObject *item;
+        if (ret == NULL) {
+            if (j->out.text != j->out.local)
+                PyMem_RawFree(j->out.text);
+            continue;
+        }
+        item = result_object(&j->out);
+        if (item == NULL) {
+            if (!PyErr_ExceptionMatches(aparseError)) {
+                Py_CLEAR(ret);
+                continue;
+            }
+            /* Entries that fail to parse or format come back as None. */
+            PyErr_Clear();
+            item = Py_None;
+            Py_INCREF(item);
+        }
+        PyList_SET_ITEM(ret, i, item);
+    }
+
+done:
+    if (p.jobs) {
+        for (i = 0; i < count; i++)
+            Py_XDECREF(p.jobs[i].handle);
+    }
+    PyMem_Free(p.jobs);
+    if (p.lock)
+        PyThread_free_lock(p.lock);
+    if (p.finished)
+        PyThread_free_lock(p.finished);
+    Py_DECREF(texts);
+    return ret;
+}
+
+static PyObject *
+aparse_cache_info(PyObject *self, PyObject *noargs)
+{
+    return Py_BuildValue("{sKsKsnsn}",
+                         "hits", cache_hits,
+                         "misses", cache_misses,
+                         "maxsize", cache_size,
+                         "currsize", PyDict_GET_SIZE(cache));
+}
+
+static PyObject *
+aparse_cache_clear(PyObject *self, PyObject *noargs)
+{
+    PyDict_Clear(cache);
+    cache_hits = cache_misses = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+aparse_set_cache_size(PyObject *self, PyObject *args)
+{
+    Py_ssize_t size;
+
+    if (!PyArg_ParseTuple(args, "n", &size))
+        return NULL;
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache size must be >= 0");
+        return NULL;
+    }
+    cache_size = size;
+    /* Drop the oldest entries that no longer fit. */
+    while (PyDict_GET_SIZE(cache) > cache_size) {
+        PyObject *oldest, *value;
+        Py_ssize_t pos = 0;
+        if (!PyDict_Next(cache, &pos, &oldest, &value))
+            break;
+        Py_INCREF(oldest);
+        if (PyDict_DelItem(cache, oldest) < 0) {
+            Py_DECREF(oldest);
+            return NULL;
+        }
+        Py_DECREF(oldest);
+    }
+    Py_RETURN_NONE;
 }
 
 
 static PyMethodDef aparseMethods[] = {
     {"parser",  aparse_parser, METH_VARARGS,
-     "Execute a shell command."},
+     "parser(expression) -> 'numerator/denominator'\n\n"
+     "Evaluates the expression with x = 3 and y = 4."},
+    {"compile", (PyCFunction)(void (*)(void))aparse_compile, METH_VARARGS | METH_KEYWORDS,
+     "compile(expression, variables=('x', 'y')) -> Expression\n\n"
+     "Returns a reusable compiled expression. Results are cached."},
+    {"parse_many", (PyCFunction)(void (*)(void))aparse_parse_many, METH_VARARGS | METH_KEYWORDS,
+     "parse_many(expressions, threads=0) -> list\n\n"
+     "Evaluates each expression like parser() across a pool of native threads\n"
+     "(0 means one per CPU). Entries that fail come back as None."},
+    {"cache_info", aparse_cache_info, METH_NOARGS,
+     "Returns the hits, misses, maxsize and currsize of the expression cache."},
+    {"cache_clear", aparse_cache_clear, METH_NOARGS,
+     "Empties the expression cache and resets its counters."},
+    {"set_cache_size", aparse_set_cache_size, METH_VARARGS,
+     "Sets how many compiled expressions are kept; 0 disables caching."},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -51,13 +852,14 @@ static struct PyModuleDef aparsemodule = {
 };
 
 
-static PyObject *aparseError;
-
 PyMODINIT_FUNC
 PyInit_aparse(void)
 {
     PyObject *m;
 
+    if (PyType_Ready(&ExpressionType) < 0)
+        return NULL;
+
     m = PyModule_Create(&aparsemodule);
     if (m == NULL)
         return NULL;
@@ -71,6 +873,19 @@ PyInit_aparse(void)
         return NULL;
     }
 
+    Py_INCREF(&ExpressionType);
+    if (PyModule_AddObject(m, "Expression", (PyObject *)&ExpressionType) < 0) {
+        Py_DECREF(&ExpressionType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    cache = PyDict_New();
+    default_names = Py_BuildValue("(ss)", "x", "y");
+    if (cache == NULL || default_names == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
     return m;
 }
-
@@ -0,0 +1,316 @@
+/* Micro-benchmarks for the lexer, the compiler and the evaluator.
+ *
+ *   cc -O2 bench.c -lm -lpthread -o bench
+ *   bench [-t seconds] [-r repeats] [-c]
+ *
+ * bench.c includes tinyexpr_5.c itself, so that the lexer can be timed on
+ * its own; do not link tinyexpr_5.c in as well.
+ *
+ * Every category of the corpus is timed in three phases:
+ *   lex       next_token over the whole formula, literals converted included
+ *   compile   te_compile and te_free: parse and optimize
+ *   eval      te_eval of the compiled formula, with x changing every call
+ * A phase loops over the category's formulas until it has run for -t
+ * seconds (default 0.2), -r times (default 5). The report is one JSON
+ * object on stdout; ns_per_op is per formula, best and median over the
+ * repeats. The corpus is generated from a fixed seed, so runs compare.
+ *
+ * -c prints the corpus instead, one "category<TAB>formula" per line, which
+ * is what bench_aparse.py reads to time the same formulas through Python. */
+
+#include "tinyexpr_5.c"
+
+#ifdef _WIN32
+#include <windows.h>
+static double now(void) {
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+}
+#else
+#include <time.h>
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+#endif
+
+#define VAR_COUNT 34        /* x, y and v0..v31. */
+#define PER_CATEGORY 8      /* Formulas per category. */
+#define MAX_REPEATS 64
+
+typedef struct formula {
+    const char *category;
+    char *text;
+} formula;
+
+typedef struct corpus {
+    formula items[64];
+    int count;
+    char names[VAR_COUNT][4];
+    Rational values[VAR_COUNT];
+    te_variable vars[VAR_COUNT];
+} corpus;
+
+static const char *const categories[] = {"short", "deep", "wide", "literals", "variables", "prefixes"};
+#define CATEGORY_COUNT ((int)(sizeof(categories) / sizeof(categories[0])))
+
+static unsigned long long seed = 0x9E3779B97F4A7C15ull;
+
+/* xorshift64*, so the corpus is the same everywhere. */
+static unsigned pick(unsigned range) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (unsigned)((seed * 0x2545F4914F6CDD1Dull) >> 33) % range;
+}
+
+typedef struct text {
+    char *data;
+    size_t len, cap;
+} text;
+
+static void put(text *t, const char *s) {
+    const size_t len = strlen(s);
+    if (t->len + len + 1 > t->cap) {
+        t->cap = (t->len + len + 1) * 2;
+        t->data = realloc(t->data, t->cap);
+        if (!t->data) {
+            fputs("out of memory\n", stderr);
+            exit(1);
+        }
+    }
+    memcpy(t->data + t->len, s, len + 1);
+    t->len += len;
+}
+
+static const char *op(void) {
+    static const char *const ops[] = {"+", "-", "*", "/"};
+    return ops[pick(4)];
+}
+
+static const char *small(void) {
+    static char buf[16];
+    sprintf(buf, "%u", 1 + pick(99));
+    return buf;
+}
+
+static const char *literal(void) {
+    static const char *const forms[] = {"%u", "%u.%u", "%u.%ue-3", "%ue2", "0.%u", "%u%u"};
+    static char buf[48];
+    sprintf(buf, forms[pick(6)], 1 + pick(99999), pick(1000));
+    return buf;
+}
+
+static const char *prefix(void) {
+    static const char *const prefixes[] = {"k", "M", "Mhz", "n", "m", "u", "G", "p"};
+    return prefixes[pick(8)];
+}
+
+static char *make(const char *category, int i) {
+    static const char *const shorts[PER_CATEGORY] = {
+        "x+y", "x*y-1", "(x+1)/(y-1)", "2*x^2", "-x", "x/3+y/7", "abs(x-y)", "x%3"
+    };
+    text t = {0, 0, 0};
+    int k;
+
+    if (!strcmp(category, "short")) {
+        put(&t, shorts[i]);
+    } else if (!strcmp(category, "deep")) {
+        /* Nesting 16..128: ((((x+1)*2-y)/3 ... */
+        const int depth = 16 << (i % 4);
+        for (k = 0; k < depth; ++k) put(&t, "(");
+        put(&t, "x");
+        for (k = 0; k < depth; ++k) {
+            put(&t, op());
+            put(&t, pick(2) ? "y" : small());
+            put(&t, ")");
+        }
+    } else if (!strcmp(category, "wide")) {
+        /* 64..512 terms at one level. */
+        const int terms = 64 << (i % 4);
+        for (k = 0; k < terms; ++k) {
+            if (k) put(&t, pick(2) ? "+" : "-");
+            put(&t, pick(2) ? "x" : "y");
+            put(&t, "*");
+            put(&t, small());
+        }
+    } else if (!strcmp(category, "literals")) {
+        for (k = 0; k < 16 + 8 * i; ++k) {
+            if (k) put(&t, op());
+            put(&t, literal());
+        }
+        put(&t, "+x");
+    } else if (!strcmp(category, "variables")) {
+        char name[8];
+        for (k = 0; k < 16 + 8 * i; ++k) {
+            if (k) put(&t, op());
+            sprintf(name, "v%u", pick(32));
+            put(&t, name);
+        }
+    } else {
+        for (k = 0; k < 8 + 4 * i; ++k) {
+            if (k) put(&t, pick(2) ? "+" : "-");
+            put(&t, small());
+            put(&t, "*");
+            put(&t, prefix());
+            if (pick(2)) put(&t, "*x");
+        }
+    }
+    return t.data;
+}
+
+static void corpus_create(corpus *c) {
+    int i, k;
+    c->count = 0;
+    for (i = 0; i < CATEGORY_COUNT; ++i) {
+        for (k = 0; k < PER_CATEGORY; ++k) {
+            c->items[c->count].category = categories[i];
+            c->items[c->count].text = make(categories[i], k);
+            ++c->count;
+        }
+    }
+    for (i = 0; i < VAR_COUNT; ++i) {
+        if (i < 2) strcpy(c->names[i], i ? "y" : "x");
+        else sprintf(c->names[i], "v%d", i - 2);
+        c->values[i] = Fraction(i + 3, i + 2);
+        c->vars[i].name = c->names[i];
+        c->vars[i].address = &c->values[i];
+        c->vars[i].type = TE_VARIABLE;
+        c->vars[i].context = 0;
+    }
+}
+
+
+/* One pass of a phase over the formulas first..first+count. Returns a
+ * checksum, so that nothing is optimized away. */
+typedef long long (*phase)(corpus *c, const te_symbols *sym, te_expr **compiled, int first, int count);
+
+static long long lex(corpus *c, const te_symbols *sym, te_expr **compiled, int first, int count) {
+    long long tokens = 0;
+    int i;
+    (void)compiled;
+    for (i = first; i < first + count; ++i) {
+        state s;
+        memset(&s, 0, sizeof(s));
+        s.start = s.next = c->items[i].text;
+        s.lookup = c->vars;
+        s.lookup_len = VAR_COUNT;
+        s.symbols = sym;
+        do {
+            next_token(&s);
+            ++tokens;
+        } while (s.type != TOK_END && s.type != TOK_ERROR);
+    }
+    return tokens;
+}
+
+static long long compile(corpus *c, const te_symbols *sym, te_expr **compiled, int first, int count) {
+    long long nodes = 0;
+    int i, error;
+    (void)sym;
+    (void)compiled;
+    for (i = first; i < first + count; ++i) {
+        te_expr *n = te_compile(c->items[i].text, c->vars, VAR_COUNT, &error);
+        nodes += n ? n->type : error;
+        te_free(n);
+    }
+    return nodes;
+}
+
+static long long eval(corpus *c, const te_symbols *sym, te_expr **compiled, int first, int count) {
+    long long sum = 0;
+    int i;
+    (void)sym;
+    for (i = first; i < first + count; ++i) {
+        Rational r;
+        c->values[0].numerator = 1 + (c->values[0].numerator & 63);
+        r = te_eval(compiled[i]);
+        sum += r.numerator ^ r.denominator;
+    }
+    return sum;
+}
+
+static int compare(const void *a, const void *b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct {const char *name; phase run;} phases[] = {
+        {"lex", lex}, {"compile", compile}, {"eval", eval}
+    };
+    corpus c;
+    te_symbols *sym;
+    te_expr *compiled[64];
+    double seconds = 0.2, runs[MAX_REPEATS];
+    int repeats = 5, print = 0, first_result = 1, i, p, r;
+    long long checksum = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc) repeats = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c")) print = 1;
+        else {
+            fprintf(stderr, "usage: %s [-t seconds] [-r repeats] [-c]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (repeats < 1) repeats = 1;
+    if (repeats > MAX_REPEATS) repeats = MAX_REPEATS;
+
+    corpus_create(&c);
+    if (print) {
+        for (i = 0; i < c.count; ++i) printf("%s\t%s\n", c.items[i].category, c.items[i].text);
+        return 0;
+    }
+
+    sym = te_symbols_create(c.vars, VAR_COUNT);
+    for (i = 0; i < c.count; ++i) {
+        int error;
+        compiled[i] = te_compile(c.items[i].text, c.vars, VAR_COUNT, &error);
+        if (!compiled[i]) {
+            fprintf(stderr, "%s formula %d: error at %d\n", c.items[i].category, i % PER_CATEGORY, error);
+            return 1;
+        }
+    }
+
+    printf("{\n  \"benchmark\": \"tinyexpr\",\n  \"seconds\": %g,\n  \"repeats\": %d,\n  \"results\": [", seconds, repeats);
+    for (i = 0; i < CATEGORY_COUNT; ++i) {
+        const int first = i * PER_CATEGORY;
+        size_t bytes = 0;
+        int k;
+        for (k = first; k < first + PER_CATEGORY; ++k) bytes += strlen(c.items[k].text);
+
+        for (p = 0; p < (int)(sizeof(phases) / sizeof(phases[0])); ++p) {
+            long long ops = 0;
+            for (r = 0; r < repeats; ++r) {
+                const double start = now();
+                double elapsed;
+                long long passes = 0;
+                do {
+                    checksum += phases[p].run(&c, sym, compiled, first, PER_CATEGORY);
+                    ++passes;
+                } while ((elapsed = now() - start) < seconds);
+                ops = passes * PER_CATEGORY;
+                runs[r] = elapsed * 1e9 / (double)ops;
+            }
+            qsort(runs, repeats, sizeof(double), compare);
+            printf("%s\n    {\"category\": \"%s\", \"phase\": \"%s\", \"formulas\": %d, \"bytes\": %lu, "
+                    "\"ops\": %lld, \"ns_per_op\": %.1f, \"ns_per_op_median\": %.1f}",
+                    first_result ? "" : ",", categories[i], phases[p].name, PER_CATEGORY, (unsigned long)bytes,
+                    ops, runs[0], runs[repeats / 2]);
+            first_result = 0;
+        }
+    }
+    printf("\n  ],\n  \"checksum\": %lld\n}\n", checksum);
+
+    for (i = 0; i < c.count; ++i) {
+        te_free(compiled[i]);
+        free(c.items[i].text);
+    }
+    te_symbols_free(sym);
+    return 0;
+}
@@ -0,0 +1,106 @@
+"""Times the aparse Python round trip on the corpus of bench.c.
+
+    bench -c > corpus.txt
+    python bench_aparse.py [-t seconds] [-r repeats] [corpus.txt]
+
+The corpus is read from the file, or from stdin without one. Each category
+is timed in three phases, per formula:
+
+    roundtrip   compile() with the cache off, then eval(): str in, str out
+    cached      compile() answered from the cache, then eval()
+    eval        eval() on a handle compiled beforehand
+
+The report is one JSON object on stdout, in the same shape as bench's, so
+the two can be tracked side by side.
+"""
+
+import argparse
+import json
+import sys
+import time
+from fractions import Fraction
+
+import aparse
+
+NAMES = ('x', 'y') + tuple('v%d' % i for i in range(32))
+VALUES = {name: Fraction(i + 3, i + 2) for i, name in enumerate(NAMES)}
+
+
+def read_corpus(stream):
+    categories = {}
+    for line in stream:
+        line = line.rstrip('\n')
+        if line:
+            category, formula = line.split('\t', 1)
+            categories.setdefault(category, []).append(formula)
+    return categories
+
+
+def compile_eval(formulas, handles):
+    for f in formulas:
+        aparse.compile(f, NAMES).eval(**VALUES)
+
+
+def evaluate(formulas, handles):
+    for h in handles:
+        h.eval(**VALUES)
+
+
+# Name, pass, cache size while it runs.
+PHASES = (('roundtrip', compile_eval, 0), ('cached', compile_eval, 1024), ('eval', evaluate, 1024))
+
+
+def measure(run, formulas, handles, seconds, repeats):
+    """Returns ns per formula for each repeat, sorted, and the last op count."""
+    runs = []
+    ops = 0
+    for _ in range(repeats):
+        passes = 0
+        start = time.perf_counter()
+        while True:
+            run(formulas, handles)
+            passes += 1
+            elapsed = time.perf_counter() - start
+            if elapsed >= seconds:
+                break
+        ops = passes * len(formulas)
+        runs.append(elapsed * 1e9 / ops)
+    return sorted(runs), ops
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('-t', type=float, default=0.2, dest='seconds')
+    parser.add_argument('-r', type=int, default=5, dest='repeats')
+    parser.add_argument('corpus', nargs='?')
+    args = parser.parse_args()
+
+    if args.corpus:
+        with open(args.corpus) as f:
+            categories = read_corpus(f)
+    else:
+        categories = read_corpus(sys.stdin)
+
+    results = []
+    maxsize = aparse.cache_info()['maxsize']
+    try:
+        for category, formulas in categories.items():
+            handles = [aparse.compile(f, NAMES) for f in formulas]
+            for name, run, cache_size in PHASES:
+                aparse.set_cache_size(cache_size)
+                runs, ops = measure(run, formulas, handles, args.seconds, max(args.repeats, 1))
+                results.append({
+                    'category': category, 'phase': name, 'formulas': len(formulas),
+                    'bytes': sum(len(f) for f in formulas), 'ops': ops,
+                    'ns_per_op': round(runs[0], 1), 'ns_per_op_median': round(runs[len(runs) // 2], 1),
+                })
+    finally:
+        aparse.set_cache_size(maxsize)
+
+    json.dump({'benchmark': 'aparse', 'seconds': args.seconds, 'repeats': args.repeats, 'results': results},
+              sys.stdout, indent=2)
+    sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()
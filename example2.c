@@ -1,38 +1,672 @@
+/* Streaming evaluator.
+ *
+ *   example2 -e "expression"                one expression, x = 3 and y = 4
+ *   example2 [options] [file...]            one expression per input line
+ *   example2 -f "expression" [file...]      one row of variable values per line
+ *
+ * Options:
+ *   -v x=3,y=4   variables, with the values expression lines see (default x=3,y=4)
+ *   -b           binary output: numerator and denominator as native 64-bit integers
+ *   -j N         worker threads (default 1)
+ *
+ * Input comes from the files, or stdin without any. Rows hold one value per
+ * variable, in -v order, separated by spaces, tabs or commas; a value is an
+ * integer, a decimal or a fraction such as -3/4. Blank lines are skipped and
+ * every other line gives one result, in input order: "numerator/denominator",
+ * "0/0" when not representable, or "error N" for a syntax error or an
+ * unreadable row value at column N, which binary output writes as 0/0.
+ *
+ * Input is read in blocks of up to a few megabytes, each taking whatever
+ * complete lines have arrived, and split in place. Each worker compiles an
+ * expression once and keeps it for as long as the same text recurs; rows go
+ * through te_eval_batch. Blocks are handed out to the workers and written
+ * back, and flushed, in the order they were read, so a caller writing to a
+ * pipe gets each answer without closing it first. */
+
 #include "tinyexpr.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
-int main(int argc, char *argv[])
-{
-    if (argc < 2) {
-        printf("Usage: example2 \"expression\"\n");
-        return 0;
-    }
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_THREADS
+#else
+#include <io.h>
+#endif
 
-    const char *expression = argv[1];
-    // printf("DEUBG: Evaluating:\n\t%s\n", expression);
+#define BLOCK_SIZE (1 << 20)
+#define MAX_VARS 64
+#define MAX_THREADS 64
+#define CACHE_SIZE 1024     /* Distinct expressions a worker keeps compiled; a power of two. */
 
-    /* This shows an example where the variables
-     * x and y are bound at eval-time. */
-    double x, y;
-    te_variable vars[] = {{"x", &x}, {"y", &y}};
+typedef struct options {
+    const char *formula;
+    char *names[MAX_VARS];
+    Rational values[MAX_VARS];
+    int var_count;
+    int binary;
+    int threads;
+} options;
 
-    /* This will compile the expression and check for errors. */
-    int err;
-    te_expr *n = te_compile(expression, vars, 2, &err);
+typedef struct cached {
+    char *text;
+    te_bytecode *code;
+    int error;
+} cached;
 
-    if (n) {
-        /* The variables can be changed here, and eval can be called as many
-         * times as you like. This is fairly efficient because the parsing has
-         * already been done. */
-        x = 3; y = 4;
-        Rational r = te_eval(n); printf("Result:\n\t(%lld,%lld)\n", r.numerator,r.denominator);
+typedef struct worker {
+    const options *opt;
+    Rational values[MAX_VARS];
+    te_variable vars[MAX_VARS];
+    te_context *ctx;
+    cached cache[CACHE_SIZE];
+    te_expr *formula;               /* Row mode. */
+    /* Row mode columns, one block's worth. */
+    long long *columns;             /* numerators then denominators, per variable */
+    long long *results;
+    int *errors;                    /* Per row: 0, or where it stopped parsing. */
+    int capacity;
+} worker;
 
-        te_free(n);
+typedef struct job {
+    char *in;
+    size_t in_size;
+    char *out;
+    size_t out_size, out_capacity;
+    int state;                      /* EMPTY, QUEUED, RUNNING, DONE */
+    long long sequence;             /* Order read. */
+} job;
+
+enum {EMPTY, QUEUED, RUNNING, DONE};
+
+
+/* Output. */
+
+static void reserve(job *j, size_t more) {
+    if (j->out_size + more <= j->out_capacity) return;
+    while (j->out_size + more > j->out_capacity) j->out_capacity = j->out_capacity ? j->out_capacity * 2 : 4096;
+    j->out = realloc(j->out, j->out_capacity);
+    if (!j->out) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+static char *put_integer(char *p, long long v) {
+    char digits[24];
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    int n = 0;
+    do digits[n++] = (char)('0' + u % 10); while (u /= 10);
+    if (v < 0) *p++ = '-';
+    while (n) *p++ = digits[--n];
+    return p;
+}
+
+static void put_result(job *j, const options *opt, long long num, long long den) {
+    reserve(j, 2 * sizeof(long long) + 48);
+    if (opt->binary) {
+        memcpy(j->out + j->out_size, &num, sizeof(num));
+        memcpy(j->out + j->out_size + sizeof(num), &den, sizeof(den));
+        j->out_size += 2 * sizeof(long long);
+    } else {
+        char *p = j->out + j->out_size;
+        p = put_integer(p, num);
+        *p++ = '/';
+        p = put_integer(p, den);
+        *p++ = '\n';
+        j->out_size = p - j->out;
+    }
+}
+
+static void put_error(job *j, const options *opt, int error) {
+    if (opt->binary) {
+        put_result(j, opt, 0, 0);
     } else {
-        /* Show the user where the error is at. */
-        printf("\t%*s^\nError near here", err-1, "");
+        char *p;
+        reserve(j, 32);
+        p = j->out + j->out_size;
+        memcpy(p, "error ", 6);
+        p = put_integer(p + 6, error);
+        *p++ = '\n';
+        j->out_size = p - j->out;
+    }
+}
+
+
+/* Values: [-]digits[.digits][/digits], left unreduced for te_eval_batch. */
+static int parse_value(const char *p, const char *end, long long *num, long long *den) {
+    long long n = 0, d = 1, q;
+    int negative = 0, digits = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+        if (n > (LLONG_MAX - (*p - '0')) / 10) return 0;
+        n = n * 10 + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            if (n > (LLONG_MAX - (*p - '0')) / 10 || d > LLONG_MAX / 10) return 0;
+            n = n * 10 + (*p - '0');
+            d *= 10;
+        }
+    }
+    if (!digits) return 0;
+    if (p < end && *p == '/') {
+        for (q = 0, ++p, digits = 0; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            if (q > (LLONG_MAX - (*p - '0')) / 10) return 0;
+            q = q * 10 + (*p - '0');
+        }
+        if (!digits || !q || d > LLONG_MAX / q) return 0;
+        d *= q;
+    }
+    if (p != end) return 0;
+    *num = negative ? -n : n;
+    *den = d;
+    return 1;
+}
+
+static int is_separator(char c) {
+    return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+
+/* Expression lines. */
+
+static unsigned hash_text(const char *s) {
+    unsigned h = 2166136261u;
+    for (; *s; ++s) h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static void clear_cache(worker *w) {
+    int i;
+    for (i = 0; i < CACHE_SIZE; ++i) {
+        free(w->cache[i].text);
+        te_bytecode_free(w->cache[i].code);
+        w->cache[i].text = 0;
+        w->cache[i].code = 0;
+    }
+}
+
+/* A direct-mapped cache: a colliding expression replaces the older one. */
+static cached *compile_line(worker *w, char *line) {
+    cached *c = w->cache + (hash_text(line) & (CACHE_SIZE - 1));
+    te_expr *n;
+    int error;
+
+    if (c->text && strcmp(c->text, line) == 0) return c;
+    free(c->text);
+    te_bytecode_free(c->code);
+    c->text = malloc(strlen(line) + 1);
+    if (c->text) strcpy(c->text, line);
+    n = te_context_compile(w->ctx, line, &error);
+    c->code = n ? te_bytecode_compile(n) : 0;
+    c->error = n ? 0 : error;
+    te_free(n);
+    return c;
+}
+
+static void run_expressions(worker *w, job *j) {
+    char *line = j->in, *end = j->in + j->in_size;
+
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        if (eol > line && eol[-1] == '\r') eol[-1] = '\0';
+        *eol = '\0';
+        if (line[strspn(line, " \t\r")]) {
+            const cached *c = compile_line(w, line);
+            if (c->code) {
+                const Rational r = te_bytecode_eval(c->code);
+                put_result(j, w->opt, r.numerator, r.denominator);
+            } else {
+                put_error(j, w->opt, c->error);
+            }
+        }
+        line = eol + 1;
+    }
+}
+
+
+/* Rows. */
+
+/* Columns are laid out capacity apart, so growing moves each one. */
+static void grow_rows(worker *w, int rows) {
+    const int old = w->capacity;
+    long long *columns;
+    int v;
+
+    w->capacity = rows < 1024 ? 1024 : rows * 2;
+    columns = malloc(sizeof(long long) * 2 * MAX_VARS * w->capacity);
+    if (columns && w->columns) {
+        for (v = 0; v < 2 * w->opt->var_count; ++v) memcpy(columns + v * w->capacity, w->columns + v * old, sizeof(long long) * old);
+    }
+    free(w->columns);
+    w->columns = columns;
+    w->results = realloc(w->results, sizeof(long long) * 2 * w->capacity);
+    w->errors = realloc(w->errors, sizeof(int) * w->capacity);
+    if (!w->columns || !w->results || !w->errors) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+static void run_rows(worker *w, job *j) {
+    const int vars = w->opt->var_count;
+    char *line = j->in, *end = j->in + j->in_size;
+    te_column columns[MAX_VARS];
+    int rows = 0, i, v;
+
+    /* Split the block into rows and the rows into columns. A row that does
+     * not parse is evaluated on zeros and reported as an error. */
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line), *p;
+        if (!eol) eol = end;
+        p = line;
+        while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+        if (p < eol) {
+            if (rows == w->capacity) grow_rows(w, rows + 1);
+            for (v = 0; v < vars; ++v) {
+                char *q = p;
+                while (q < eol && !is_separator(*q)) ++q;
+                if (!parse_value(p, q, w->columns + (2 * v) * w->capacity + rows, w->columns + (2 * v + 1) * w->capacity + rows)) break;
+                p = q;
+                while (p < eol && is_separator(*p)) ++p;
+            }
+            w->errors[rows] = v == vars && p == eol ? 0 : (int)(p - line) + 1;
+            if (w->errors[rows]) {
+                for (v = 0; v < vars; ++v) {
+                    w->columns[(2 * v) * w->capacity + rows] = 0;
+                    w->columns[(2 * v + 1) * w->capacity + rows] = 1;
+                }
+            }
+            ++rows;
+        }
+        line = eol + 1;
+    }
+    if (!rows) return;
+
+    for (v = 0; v < vars; ++v) {
+        columns[v].numerator = w->columns + (2 * v) * w->capacity;
+        columns[v].denominator = w->columns + (2 * v + 1) * w->capacity;
+    }
+    if (te_eval_batch(w->formula, w->vars, columns, vars, rows, w->results, w->results + w->capacity) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < rows; ++i) {
+        if (!w->errors[i]) put_result(j, w->opt, w->results[i], w->results[w->capacity + i]);
+        else put_error(j, w->opt, w->errors[i]);
+    }
+}
+
+static void run_job(worker *w, job *j) {
+    j->out_size = 0;
+    if (w->opt->formula) run_rows(w, j);
+    else run_expressions(w, j);
+}
+
+static int worker_init(worker *w, const options *opt) {
+    int i;
+    memset(w, 0, sizeof(*w));
+    w->opt = opt;
+    for (i = 0; i < opt->var_count; ++i) {
+        w->values[i] = opt->values[i];
+        w->vars[i].name = opt->names[i];
+        w->vars[i].address = w->values + i;
+    }
+    w->ctx = te_context_create(w->vars, opt->var_count);
+    if (!w->ctx) return 0;
+    if (opt->formula) {
+        int error;
+        w->formula = te_context_compile(w->ctx, opt->formula, &error);
+        if (!w->formula) return 0;
+    }
+    return 1;
+}
+
+static void worker_free(worker *w) {
+    clear_cache(w);
+    te_free(w->formula);
+    te_context_free(w->ctx);
+    free(w->columns);
+    free(w->results);
+    free(w->errors);
+}
+
+
+/* Input: blocks end at a line boundary; a partial last line moves to the next block. */
+
+typedef struct reader {
+    FILE **files;
+    int file_count, current;
+    char carry[2 * BLOCK_SIZE];
+    size_t carry_size;
+} reader;
+
+/* Reads what f has available, up to size; 0 at its end. A pipe gives what
+ * has arrived instead of waiting for size bytes. */
+static size_t read_some(FILE *f, char *buf, size_t size) {
+#ifndef _WIN32
+    ssize_t got;
+    do got = read(fileno(f), buf, size); while (got < 0 && errno == EINTR);
+#else
+    int got = _read(_fileno(f), buf, size < INT_MAX ? (unsigned)size : INT_MAX);
+#endif
+    return got > 0 ? (size_t)got : 0;
+}
+
+/* Fills j->in with whole lines, as many as have arrived once there is one.
+ * Returns 0 at the end of all input. */
+static int read_block(reader *r, job *j) {
+    size_t size = r->carry_size, got;
+    char *cut;
+
+    if (!j->in) j->in = malloc(2 * BLOCK_SIZE + 1);
+    if (!j->in) return 0;
+    memcpy(j->in, r->carry, r->carry_size);
+    r->carry_size = 0;
+
+    while (size < BLOCK_SIZE && r->current < r->file_count) {
+        got = read_some(r->files[r->current], j->in + size, 2 * BLOCK_SIZE - size);
+        if (!got) {
+            /* A file that does not end in a newline still ends its line. */
+            if (size && j->in[size - 1] != '\n') j->in[size++] = '\n';
+            ++r->current;
+            continue;
+        }
+        size += got;
+        if (memchr(j->in + size - got, '\n', got)) break;
+    }
+
+    cut = size ? j->in + size : 0;
+    while (cut && cut > j->in && cut[-1] != '\n') --cut;
+    if (cut == j->in && size) {
+        if (r->current < r->file_count) {
+            fprintf(stderr, "line longer than %d bytes\n", 2 * BLOCK_SIZE);
+            exit(1);
+        }
+        cut = j->in + size;
+    }
+    if (cut) {
+        r->carry_size = j->in + size - cut;
+        memcpy(r->carry, cut, r->carry_size);
+        size = cut - j->in;
     }
+    j->in_size = size;
+    j->in[size] = '\0';
+    return size > 0;
+}
+
+static void write_job(job *j) {
+    fwrite(j->out, 1, j->out_size, stdout);
+    fflush(stdout);
+}
+
+
+#ifdef HAVE_THREADS
+typedef struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t queued, done;
+    job *jobs;
+    int job_count;
+    int stop;
+} pool;
+
+typedef struct pool_worker {
+    pool *p;
+    worker w;
+} pool_worker;
 
+static void *pool_run(void *arg) {
+    pool_worker *pw = arg;
+    pool *p = pw->p;
+    int i, k;
 
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        /* Oldest first, so the block the writer waits on is never passed over. */
+        for (i = -1, k = 0; k < p->job_count; ++k) {
+            if (p->jobs[k].state == QUEUED && (i < 0 || p->jobs[k].sequence < p->jobs[i].sequence)) i = k;
+        }
+        if (i < 0) {
+            if (p->stop) break;
+            pthread_cond_wait(&p->queued, &p->lock);
+            continue;
+        }
+        p->jobs[i].state = RUNNING;
+        pthread_mutex_unlock(&p->lock);
+        run_job(&pw->w, p->jobs + i);
+        pthread_mutex_lock(&p->lock);
+        p->jobs[i].state = DONE;
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
     return 0;
 }
+
+/* 1 if reading would not wait: input is buffered, at its end, or a file. */
+static int input_ready(const reader *r) {
+    struct pollfd fd;
+    if (r->current >= r->file_count) return 1;
+    fd.fd = fileno(r->files[r->current]);
+    fd.events = POLLIN;
+    fd.revents = 0;
+    return poll(&fd, 1, 0) != 0;
+}
+
+/* Waits for the jobs after head, oldest first, and writes them. */
+static void drain(pool *p, int head) {
+    int i;
+    for (i = 1; i < p->job_count; ++i) {
+        job *k = p->jobs + (head + i) % p->job_count;
+        pthread_mutex_lock(&p->lock);
+        while (k->state == QUEUED || k->state == RUNNING) pthread_cond_wait(&p->done, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+        if (k->state == DONE) write_job(k);
+        k->state = EMPTY;
+    }
+}
+
+/* The reader fills a ring of twice as many blocks as workers and writes
+ * them back in ring order as each finishes. Before it would wait for more
+ * input it writes everything in flight, so a caller waiting for answers
+ * gets them. */
+static int run_threads(const options *opt, reader *r) {
+    pool p;
+    pool_worker *workers = calloc(opt->threads, sizeof(pool_worker));
+    pthread_t *threads = calloc(opt->threads, sizeof(pthread_t));
+    int i, head = 0, more = 1, started = 0;
+    long long sequence = 0;
+
+    memset(&p, 0, sizeof(p));
+    p.job_count = 2 * opt->threads;
+    p.jobs = calloc(p.job_count, sizeof(job));
+    if (!workers || !threads || !p.jobs) return 1;
+    pthread_mutex_init(&p.lock, 0);
+    pthread_cond_init(&p.queued, 0);
+    pthread_cond_init(&p.done, 0);
+
+    for (i = 0; i < opt->threads; ++i) {
+        workers[i].p = &p;
+        if (!worker_init(&workers[i].w, opt)) return 1;
+        if (pthread_create(threads + i, 0, pool_run, workers + i) != 0) break;
+        ++started;
+    }
+    if (!started) return 1;
+
+    for (;;) {
+        job *j = p.jobs + head;
+        pthread_mutex_lock(&p.lock);
+        while (j->state == QUEUED || j->state == RUNNING) pthread_cond_wait(&p.done, &p.lock);
+        pthread_mutex_unlock(&p.lock);
+        if (j->state == DONE) {
+            write_job(j);
+            j->state = EMPTY;
+        }
+        if (more && !input_ready(r)) drain(&p, head);
+        if (more) more = read_block(r, j);
+        if (!more) {
+            drain(&p, head);
+            break;
+        }
+        pthread_mutex_lock(&p.lock);
+        j->state = QUEUED;
+        j->sequence = sequence++;
+        pthread_cond_signal(&p.queued);
+        pthread_mutex_unlock(&p.lock);
+        head = (head + 1) % p.job_count;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_broadcast(&p.queued);
+    pthread_mutex_unlock(&p.lock);
+    for (i = 0; i < started; ++i) pthread_join(threads[i], 0);
+    for (i = 0; i < opt->threads; ++i) worker_free(&workers[i].w);
+    for (i = 0; i < p.job_count; ++i) {
+        free(p.jobs[i].in);
+        free(p.jobs[i].out);
+    }
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.queued);
+    pthread_cond_destroy(&p.done);
+    free(p.jobs);
+    free(workers);
+    free(threads);
+    return 0;
+}
+#endif
+
+static int run(const options *opt, reader *r) {
+    static worker w;
+    job j;
+
+#ifdef HAVE_THREADS
+    if (opt->threads > 1) return run_threads(opt, r);
+#endif
+    memset(&j, 0, sizeof(j));
+    if (!worker_init(&w, opt)) return 1;
+    while (read_block(r, &j)) {
+        run_job(&w, &j);
+        write_job(&j);
+    }
+    worker_free(&w);
+    free(j.in);
+    free(j.out);
+    return 0;
+}
+
+
+/* "x=3,y" names x and y, x starting at 3 and y at 0. */
+static int parse_variables(options *opt, char *spec) {
+    char *item = strtok(spec, ",");
+    opt->var_count = 0;
+    for (; item; item = strtok(0, ",")) {
+        char *eq = strchr(item, '=');
+        Rational v = {0, 1};
+        if (opt->var_count == MAX_VARS) return 0;
+        if (eq) {
+            int error;
+            *eq = '\0';
+            v = te_interp(eq + 1, &error);
+            if (error) return 0;
+        }
+        opt->names[opt->var_count] = item;
+        opt->values[opt->var_count++] = v;
+    }
+    return 1;
+}
+
+static int usage(void) {
+    fprintf(stderr,
+        "Usage: example2 -e \"expression\"\n"
+        "       example2 [-v x=3,y=4] [-b] [-j threads] [file...]\n"
+        "       example2 -f \"expression\" [-v x,y] [-b] [-j threads] [file...]\n");
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    static reader r;
+    static char default_vars[] = "x=3,y=4";
+    const char *expression = 0;
+    options opt;
+    FILE *files[256];
+    int i, status;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.threads = 1;
+    parse_variables(&opt, default_vars);
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        const char flag = argv[i][1];
+        if (flag == 'b' && !argv[i][2]) {
+            opt.binary = 1;
+            continue;
+        }
+        if (argv[i][2] || i + 1 == argc) return usage();
+        switch (flag) {
+            case 'e': expression = argv[++i]; break;
+            case 'f': opt.formula = argv[++i]; break;
+            case 'v': if (!parse_variables(&opt, argv[++i])) return usage(); break;
+            case 'j': opt.threads = atoi(argv[++i]); break;
+            default: return usage();
+        }
+    }
+    if (opt.threads < 1 || opt.threads > MAX_THREADS) return usage();
+
+    if (expression || opt.formula) {
+        Rational values[MAX_VARS];
+        te_variable vars[MAX_VARS];
+        const char *text = expression ? expression : opt.formula;
+        te_expr *n;
+        int err, k;
+
+        /* The variables are bound at eval-time. */
+        for (k = 0; k < opt.var_count; ++k) {
+            values[k] = opt.values[k];
+            vars[k].name = opt.names[k];
+            vars[k].address = values + k;
+            vars[k].type = TE_VARIABLE;
+            vars[k].context = 0;
+        }
+        n = te_compile(text, vars, opt.var_count, &err);
+        if (!n) {
+            /* Show the user where the error is at. */
+            fprintf(stderr, "%s\n%*s^\nError near here\n", text, err - 1, "");
+            return 1;
+        }
+        if (expression) {
+            const Rational r = te_eval(n);
+            printf("%lld/%lld\n", r.numerator, r.denominator);
+        }
+        te_free(n);
+        if (expression) return 0;
+    }
+
+    if (i == argc) {
+        files[r.file_count++] = stdin;
+    }
+    for (; i < argc; ++i) {
+        if (r.file_count == (int)(sizeof(files) / sizeof(*files))) return usage();
+        files[r.file_count] = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+        if (!files[r.file_count]) {
+            perror(argv[i]);
+            return 1;
+        }
+        ++r.file_count;
+    }
+    r.files = files;
+
+    status = run(&opt, &r);
+    for (i = 0; i < r.file_count; ++i) {
+        if (files[i] != stdin) fclose(files[i]);
+    }
+    return status;
+}
@@ -0,0 +1,514 @@
+/* Checks the compiled paths against te_eval.
+ *
+ *   cc -O1 test.c -lm -lpthread -o test
+ *   test
+ *
+ * Like bench.c, test.c includes tinyexpr_5.c itself, so that it can reach
+ * the internals it checks; do not link tinyexpr_5.c in as well.
+ *
+ * Random formulas from a fixed seed go through the arena, bytecode, native,
+ * incremental, image, batch, program and numeric paths, each compared with
+ * te_eval of the same formula. The other checks are cases those paths got
+ * wrong once. Prints one line per failed check and exits non-zero if there
+ * was any. */
+
+#include "tinyexpr_5.c"
+
+static int failures = 0;
+
+static int same(Rational a, Rational b) {
+    return a.numerator == b.numerator && a.denominator == b.denominator;
+}
+
+static void check(int ok, const char *what, const char *expression) {
+    if (ok) return;
+    printf("FAIL %s: %s\n", what, expression);
+    ++failures;
+}
+
+static void check_value(Rational got, Rational want, const char *what, const char *expression) {
+    if (same(got, want)) return;
+    printf("FAIL %s: %s gave %lld/%lld, want %lld/%lld\n", what, expression,
+            got.numerator, got.denominator, want.numerator, want.denominator);
+    ++failures;
+}
+
+
+/* f0 = x+1, fi = f(i-1)*f(i-1)+1: as a tree the last formula doubles with
+ * every link, so this only finishes if shared terms are compiled once. */
+#define CHAIN 48
+
+static void test_program_chain(void) {
+    static char names[CHAIN][8], expressions[CHAIN][32];
+    te_formula formulas[CHAIN];
+    Rational x = {-1, 1}, values[CHAIN + 1], out[CHAIN];
+    te_variable vars[CHAIN + 1];
+    te_program *prog;
+    int i, failed, error;
+
+    for (i = 0; i < CHAIN; ++i) {
+        sprintf(names[i], "f%d", i);
+        if (i) sprintf(expressions[i], "f%d*f%d+1", i - 1, i - 1);
+        else strcpy(expressions[i], "x+1");
+        /* Listed backwards, so the program has to order them. */
+        formulas[CHAIN - 1 - i].name = names[i];
+        formulas[CHAIN - 1 - i].expression = expressions[i];
+    }
+    vars[0].name = "x";
+    vars[0].address = &x;
+    vars[0].type = TE_VARIABLE;
+    vars[0].context = 0;
+
+    prog = te_program_compile(formulas, CHAIN, vars, 1, &failed, &error);
+    check(prog != 0, "program compile", "reference chain");
+    if (!prog) return;
+    check(te_program_eval(prog, out) == 0, "program eval", "reference chain");
+
+    /* Each formula on its own, with the ones before it bound as variables. */
+    for (i = 0; i < CHAIN; ++i) {
+        te_expr *n;
+        vars[i + 1].name = names[i];
+        vars[i + 1].address = values + i;
+        vars[i + 1].type = TE_VARIABLE;
+        vars[i + 1].context = 0;
+        n = te_compile(expressions[i], vars, i + 1, &error);
+        check(n != 0, "compile", expressions[i]);
+        if (!n) continue;
+        values[i] = te_eval(n);
+        check_value(out[CHAIN - 1 - i], values[i], "program", expressions[i]);
+        te_free(n);
+    }
+    te_program_free(prog);
+}
+
+
+/* A zero-argument function without TE_FLAG_PURE: each row calls it. */
+static long long counter = 0;
+
+static Rational next_count(void) {
+    Rational r = {++counter, 1};
+    return r;
+}
+
+#define ROWS 300
+
+static void test_batch_impure(void) {
+    const char *expression = "x*2+next()";
+    Rational x;
+    te_variable vars[2];
+    te_column column;
+    long long xs[ROWS], num[ROWS], den[ROWS];
+    te_expr *n;
+    int i, error;
+
+    vars[0].name = "x";
+    vars[0].address = &x;
+    vars[0].type = TE_VARIABLE;
+    vars[0].context = 0;
+    vars[1].name = "next";
+    vars[1].address = (const void*)next_count;
+    vars[1].type = TE_FUNCTION0;
+    vars[1].context = 0;
+    n = te_compile(expression, vars, 2, &error);
+    check(n != 0, "compile", expression);
+    if (!n) return;
+
+    for (i = 0; i < ROWS; ++i) xs[i] = i - ROWS / 2;
+    column.numerator = xs;
+    column.denominator = 0;
+    counter = 0;
+    check(te_eval_batch(n, vars, &column, 1, ROWS, num, den) == 0, "batch", expression);
+
+    counter = 0;
+    for (i = 0; i < ROWS; ++i) {
+        Rational got = {num[i], den[i]};
+        x.numerator = xs[i];
+        x.denominator = 1;
+        check_value(got, te_eval(n), "batch", expression);
+    }
+
+    /* Either output may be left out; the function is still called per row. */
+    counter = 0;
+    check(te_eval_batch(n, vars, &column, 1, ROWS, 0, den) == 0, "batch without numerators", expression);
+    check(te_eval_batch(n, vars, &column, 1, ROWS, num, 0) == 0, "batch without denominators", expression);
+    check(num[ROWS - 1] == 2 * xs[ROWS - 1] + 2 * ROWS, "batch without denominators", expression);
+    check(te_eval_batch(n, vars, &column, 1, ROWS, 0, 0) == 0, "batch without outputs", expression);
+    te_free(n);
+}
+
+
+/* Exponents of any size: zero stays zero, the rest overflows. */
+static void test_exponents(void) {
+    static const Rational zero = {0, 1}, five = {5, 1}, lowest = {-9223372036854775807ll - 1, 1}, nan = {0, 0};
+    static const struct {const char *expression; Rational want;} cases[] = {
+        {"0e99999", {0, 1}}, {"0e-9223372036854775808", {0, 1}}, {"2e18", {2000000000000000000ll, 1}},
+        {"5e-1", {1, 2}}, {"2e19", {0, 0}}, {"1e-9223372036854775808", {0, 0}}, {"3e-9223372036854775807", {0, 0}}
+    };
+    int i, error;
+    for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+        check_value(te_interp(cases[i].expression, &error), cases[i].want, "exponent", cases[i].expression);
+    }
+    check_value(tenpow(five, lowest), nan, "tenpow", "5e-9223372036854775808");
+    check_value(tenpow(zero, lowest), zero, "tenpow", "0e-9223372036854775808");
+}
+
+
+/* Overflow and division by zero are NaN in every numeric mode. */
+static void test_numeric_not_finite(void) {
+    static const char *const expressions[] = {"1/0", "-1/0", "10^400", "-(10^400)", "0/0"};
+    static const int modes[] = {TE_EXACT, TE_DOUBLE, TE_MIXED};
+    int i, m, error;
+
+    for (i = 0; i < (int)(sizeof(expressions) / sizeof(expressions[0])); ++i) {
+        te_expr *n = te_compile(expressions[i], 0, 0, &error);
+        check(n != 0, "compile", expressions[i]);
+        if (!n) continue;
+        for (m = 0; m < 3; ++m) {
+            te_numeric *num = te_numeric_compile(n, modes[m]);
+            check(num && isnan(te_numeric_eval(num)), "numeric NaN", expressions[i]);
+            te_numeric_free(num);
+        }
+        te_free(n);
+    }
+}
+
+
+/* abs(x-abs(x-...)) keeps every level on the stack: a frame of several
+ * pages, which native code allocates a page at a time. */
+static void test_jit_deep(void) {
+    const int depth = 1000;
+    char *expression = malloc(depth * 8 + 2), *p = expression;
+    Rational x = {1, 3};
+    te_variable vars[1];
+    te_expr *n;
+    te_jit *j;
+    int i, error;
+
+    if (!expression) return;
+    for (i = 0; i < depth; ++i) p += sprintf(p, "abs(x-");
+    *p++ = 'x';
+    for (i = 0; i < depth; ++i) *p++ = ')';
+    *p = '\0';
+
+    vars[0].name = "x";
+    vars[0].address = &x;
+    vars[0].type = TE_VARIABLE;
+    vars[0].context = 0;
+    n = te_compile(expression, vars, 1, &error);
+    check(n != 0, "compile", "deep abs");
+    j = n ? te_jit_compile(n) : 0;
+    check(j != 0, "jit compile", "deep abs");
+    if (j) check_value(te_jit_eval(j), te_eval(n), "jit", "deep abs");
+    te_jit_free(j);
+    te_free(n);
+    free(expression);
+}
+
+
+/* An image whose first instruction loads a slot stored only later must be
+ * rejected, or evaluation would read a slot never written. */
+static void test_image_load_before_store(void) {
+    const char *expression = "abs(x)*abs(x)";
+    Rational x = {-2, 3}, values[1];
+    te_variable vars[1];
+    const te_expr *exprs[1];
+    te_expr *n;
+    te_image *img;
+    te_image_record *rec;
+    te_image_op *ops;
+    size_t size;
+    void *data;
+    int i, error;
+
+    vars[0].name = "x";
+    vars[0].address = &x;
+    vars[0].type = TE_VARIABLE;
+    vars[0].context = 0;
+    values[0] = x;
+    n = te_compile_arena(expression, vars, 1, &error);
+    check(n != 0, "compile", expression);
+    if (!n) return;
+    exprs[0] = n;
+    data = te_image_save(exprs, 1, vars, 1, &size);
+    check(data != 0, "image save", expression);
+    if (!data) {
+        te_free(n);
+        return;
+    }
+
+    img = te_image_open(data, size, vars, 1);
+    check(img != 0, "image open", expression);
+    if (img) check_value(te_image_eval(img, 0, values), te_eval(n), "image", expression);
+    te_image_close(img);
+
+    /* abs is shared, so the record is x abs store load mul: move the load first. */
+    rec = (te_image_record*)((char*)data + ((long long*)((te_image_header*)data + 1))[0]);
+    ops = (te_image_op*)(rec + 1);
+    for (i = 1; i < rec->count && ops[i].code != OP_LOAD; ++i);
+    check(ops[0].code == OP_VARIABLE && i < rec->count, "image layout", expression);
+    if (i < rec->count) ops[0] = ops[i];
+    img = te_image_open(data, size, vars, 1);
+    check(img == 0, "image load before store", expression);
+    te_image_close(img);
+    free(data);
+    te_free(n);
+}
+
+
+/* Random formulas through every compiled path, against te_eval of the
+ * tree. The formulas come from a fixed seed, as bench.c's corpus does. */
+
+#define VAR_COUNT 6         /* x, v, w, q, then halve and hyp. */
+#define GROUP 16            /* Formulas per image and per program. */
+#define GROUPS 32
+#define SETS 8              /* Variable values each formula is checked with. */
+
+static unsigned long long rng = 0x9E3779B97F4A7C15ull;
+
+/* xorshift64*, so the formulas are the same everywhere. */
+static unsigned pick(unsigned range) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (unsigned)((rng * 0x2545F4914F6CDD1Dull) >> 33) % range;
+}
+
+static const Rational halve_by = {1, 2};
+
+static Rational halve(void *context, Rational a) {
+    return mul(a, *(const Rational*)context);
+}
+
+static Rational hyp(Rational a, Rational b) {
+    return add(mul(a, a), mul(b, b));
+}
+
+typedef struct random_vars {
+    Rational values[4];
+    te_variable vars[VAR_COUNT];
+} random_vars;
+
+static void random_vars_create(random_vars *r) {
+    static const char *const names[4] = {"x", "v", "w", "q"};
+    int i;
+    for (i = 0; i < 4; ++i) {
+        r->values[i].numerator = 1;
+        r->values[i].denominator = 1;
+        r->vars[i].name = names[i];
+        r->vars[i].address = r->values + i;
+        r->vars[i].type = TE_VARIABLE;
+        r->vars[i].context = 0;
+    }
+    r->vars[4].name = "halve";
+    r->vars[4].address = (const void*)halve;
+    r->vars[4].type = TE_CLOSURE1 | TE_FLAG_PURE;
+    r->vars[4].context = (void*)&halve_by;
+    r->vars[5].name = "hyp";
+    r->vars[5].address = (const void*)hyp;
+    r->vars[5].type = TE_FUNCTION2 | TE_FLAG_PURE;
+    r->vars[5].context = 0;
+}
+
+/* Appends a formula of at most depth levels to p. Returns the end, and
+ * clears *plain if it uses more than + - * / on values. */
+static char *random_formula(char *p, int depth, int *plain) {
+    static const char *const leaves[] = {"x", "v", "w", "q", "x", "v", "3", "17", "250000", "2.5", "0.125", "k", "m"};
+    static const char *const unary[] = {"-", "abs", "floor", "ceil", "sqrt", "ln", "exp", "sin", "cos", "atan", "fac", "halve"};
+    static const char *const binary[] = {"+", "-", "*", "/", "+", "-", "*", "/", "^", "%"};
+    static const char *const calls[] = {"ncr", "atan2", "pow", "hyp"};
+    const unsigned kind = depth ? pick(10) : 0;
+
+    if (kind < 2) return p + sprintf(p, "%s", leaves[pick(sizeof(leaves) / sizeof(leaves[0]))]);
+    if (kind < 4) {
+        const char *f = unary[pick(sizeof(unary) / sizeof(unary[0]))];
+        if (*f != '-') *plain = 0;
+        p += sprintf(p, "%s(", f);
+        p = random_formula(p, depth - 1, plain);
+        return p + sprintf(p, ")");
+    }
+    if (kind < 9) {
+        const char *op = binary[pick(sizeof(binary) / sizeof(binary[0]))];
+        if (*op == '^' || *op == '%') *plain = 0;
+        p += sprintf(p, "(");
+        p = random_formula(p, depth - 1, plain);
+        p += sprintf(p, "%s", op);
+        /* Small powers, so that not every one overflows. */
+        if (*op == '^') p += sprintf(p, "%s", pick(2) ? "2" : "(1/2)");
+        else p = random_formula(p, depth - 1, plain);
+        return p + sprintf(p, ")");
+    }
+    *plain = 0;
+    p += sprintf(p, "%s(", calls[pick(sizeof(calls) / sizeof(calls[0]))]);
+    p = random_formula(p, depth - 1, plain);
+    p += sprintf(p, ",");
+    p = random_formula(p, depth - 1, plain);
+    return p + sprintf(p, ")");
+}
+
+/* The three numeric modes: exact is te_eval rounded, mixed is the double
+ * result wherever doubles hold it exactly, and for + - * / on values the
+ * double result is close to exact. */
+static void check_numeric(const te_expr *n, Rational want, int plain, const char *expression) {
+    te_numeric *exact = te_numeric_compile(n, TE_EXACT);
+    te_numeric *dbl = te_numeric_compile(n, TE_DOUBLE);
+    te_numeric *mixed = te_numeric_compile(n, TE_MIXED);
+    const double w = want.denominator ? (double)want.numerator / (double)want.denominator : NAN;
+    double e, d, m;
+
+    check(exact && dbl && mixed, "numeric compile", expression);
+    if (!exact || !dbl || !mixed) goto done;
+    e = te_numeric_eval(exact);
+    d = te_numeric_eval(dbl);
+    m = te_numeric_eval(mixed);
+    check(isnan(w) ? isnan(e) : e == to_double(want), "numeric exact", expression);
+    if (fabs(d) < TE_DOUBLE_EXACT) check(m == d, "numeric mixed", expression);
+    else if (!isnan(w)) check(m == e, "numeric mixed", expression);
+    if (plain && !isnan(w)) check(fabs(d - w) <= 1e-6 * (1 + fabs(w)), "numeric double", expression);
+done:
+    te_numeric_free(exact);
+    te_numeric_free(dbl);
+    te_numeric_free(mixed);
+}
+
+static void test_random_group(random_vars *r) {
+    static char texts[GROUP][4096], names[GROUP + 1][8], links[16];
+    te_expr *trees[GROUP], *arenas[GROUP];
+    te_bytecode *codes[GROUP];
+    te_jit *jits[GROUP];
+    te_incremental *incs[GROUP];
+    te_formula formulas[GROUP + 1];
+    Rational sets[SETS][4], wants[SETS][GROUP + 1], out[GROUP + 1];
+    long long columns[2][4][SETS], num[SETS], den[SETS];
+    te_column cols[VAR_COUNT];
+    te_variable link_vars[VAR_COUNT + GROUP];
+    const te_expr *saved[GROUP];
+    te_program *prog;
+    te_image *img = 0;
+    void *data;
+    size_t size;
+    int plain[GROUP], i, k, s, error, failed;
+
+    for (s = 0; s < SETS; ++s) {
+        for (k = 0; k < 4; ++k) {
+            const Rational v = {(long long)pick(41) - 20, 1 + pick(9)};
+            sets[s][k] = reduce(v.numerator, v.denominator);
+            columns[0][k][s] = v.numerator;
+            columns[1][k][s] = v.denominator;
+        }
+    }
+
+    for (i = 0; i < GROUP; ++i) {
+        plain[i] = 1;
+        *random_formula(texts[i], 1 + pick(5), plain + i) = '\0';
+        trees[i] = te_compile(texts[i], r->vars, VAR_COUNT, &error);
+        arenas[i] = te_compile_arena(texts[i], r->vars, VAR_COUNT, &error);
+        check(trees[i] && arenas[i], "compile", texts[i]);
+        if (!trees[i] || !arenas[i]) {
+            while (i >= 0) te_free(trees[i]), te_free(arenas[i--]);
+            return;
+        }
+        codes[i] = te_bytecode_compile(arenas[i]);
+        jits[i] = te_jit_compile(arenas[i]);
+        incs[i] = te_incremental_create(arenas[i]);
+        check(codes[i] && jits[i] && incs[i], "lower", texts[i]);
+        saved[i] = arenas[i];
+        sprintf(names[i], "f%d", i);
+        formulas[i].name = names[i];
+        formulas[i].expression = texts[i];
+    }
+
+    /* One more formula reads two of the others. */
+    sprintf(names[GROUP], "g");
+    sprintf(links, "f%u-f%u*2", pick(GROUP), pick(GROUP));
+    formulas[GROUP].name = names[GROUP];
+    formulas[GROUP].expression = links;
+    prog = te_program_compile(formulas, GROUP + 1, r->vars, VAR_COUNT, &failed, &error);
+    check(prog != 0, "program compile", links);
+
+    data = te_image_save(saved, GROUP, r->vars, VAR_COUNT, &size);
+    check(data != 0, "image save", texts[0]);
+    if (data) img = te_image_open(data, size, r->vars, VAR_COUNT);
+    check(!data || img, "image open", texts[0]);
+
+    for (s = 0; s < SETS; ++s) {
+        for (k = 0; k < 4; ++k) {
+            /* Each set changes some of the variables, so marking is partial. */
+            if (s && pick(2)) sets[s][k] = sets[s - 1][k];
+            if (!same(r->values[k], sets[s][k])) {
+                r->values[k] = sets[s][k];
+                for (i = 0; i < GROUP; ++i) if (incs[i]) te_incremental_mark(incs[i], r->values + k);
+            }
+            columns[0][k][s] = sets[s][k].numerator;
+            columns[1][k][s] = sets[s][k].denominator;
+        }
+        for (i = 0; i < GROUP; ++i) {
+            const Rational want = te_eval(trees[i]);
+            wants[s][i] = want;
+            check_value(te_eval(arenas[i]), want, "arena", texts[i]);
+            if (codes[i]) check_value(te_bytecode_eval(codes[i]), want, "bytecode", texts[i]);
+            if (jits[i]) check_value(te_jit_eval(jits[i]), want, "jit", texts[i]);
+            if (incs[i]) check_value(te_incremental_eval(incs[i]), want, "incremental", texts[i]);
+            if (img) check_value(te_image_eval(img, i, r->values), want, "image", texts[i]);
+            if (s == 0) check_numeric(trees[i], want, plain[i], texts[i]);
+        }
+
+        if (prog && te_program_eval(prog, out) == 0) {
+            te_expr *n;
+            memcpy(link_vars, r->vars, sizeof(r->vars));
+            for (i = 0; i < GROUP; ++i) {
+                check_value(out[i], wants[s][i], "program", texts[i]);
+                link_vars[VAR_COUNT + i].name = names[i];
+                link_vars[VAR_COUNT + i].address = wants[s] + i;
+                link_vars[VAR_COUNT + i].type = TE_VARIABLE;
+                link_vars[VAR_COUNT + i].context = 0;
+            }
+            n = te_compile(links, link_vars, VAR_COUNT + GROUP, &error);
+            if (n) check_value(out[GROUP], te_eval(n), "program", links);
+            te_free(n);
+        }
+    }
+
+    /* The same sets as rows of a batch. */
+    for (k = 0; k < VAR_COUNT; ++k) {
+        cols[k].numerator = k < 4 ? columns[0][k] : 0;
+        cols[k].denominator = k < 4 ? columns[1][k] : 0;
+    }
+    for (i = 0; i < GROUP; ++i) {
+        check(te_eval_batch(trees[i], r->vars, cols, VAR_COUNT, SETS, num, den) == 0, "batch", texts[i]);
+        for (s = 0; s < SETS; ++s) {
+            const Rational got = {num[s], den[s]};
+            check_value(got, wants[s][i], "batch", texts[i]);
+        }
+    }
+
+    te_program_free(prog);
+    te_image_close(img);
+    free(data);
+    for (i = 0; i < GROUP; ++i) {
+        te_incremental_free(incs[i]);
+        te_jit_free(jits[i]);
+        te_bytecode_free(codes[i]);
+        te_free(arenas[i]);
+        te_free(trees[i]);
+    }
+}
+
+static void test_random(void) {
+    random_vars r;
+    int i;
+    random_vars_create(&r);
+    for (i = 0; i < GROUPS; ++i) test_random_group(&r);
+}
+
+
+int main(void) {
+    test_program_chain();
+    test_batch_impure();
+    test_numeric_not_finite();
+    test_exponents();
+    test_jit_deep();
+    test_image_load_before_store();
+    test_random();
+    if (failures) printf("%d failed\n", failures);
+    return failures != 0;
+}
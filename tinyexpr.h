@@ -26,6 +26,8 @@
 #define TINYEXPR_H
 
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,6 +37,10 @@ struct _Rational {
 	 long long denominator;
 };
 typedef struct _Rational Rational;
+/* Results are in lowest terms with a positive denominator, and bound */
+/* variables are expected to hold values in the same form. */
+/* A zero denominator marks a value that is not representable: the */
+/* arithmetic overflowed or divided by zero. */
 
 
 typedef struct te_expr {
@@ -53,9 +59,39 @@ enum {
     TE_CLOSURE0 = 16, TE_CLOSURE1, TE_CLOSURE2, TE_CLOSURE3,
     TE_CLOSURE4, TE_CLOSURE5, TE_CLOSURE6, TE_CLOSURE7,
 
-    TE_FLAG_PURE = 32
+    TE_FLAG_PURE = 32,
+    TE_FLAG_ARENA = 64
 };
 
+typedef struct te_bytecode te_bytecode;
+typedef struct te_numeric te_numeric;
+typedef struct te_symbols te_symbols;
+typedef struct te_context te_context;
+typedef struct te_jit te_jit;
+typedef struct te_image te_image;
+typedef struct te_incremental te_incremental;
+typedef struct te_program te_program;
+
+/* Native code for one expression; it reads its variables where they are bound. */
+typedef Rational (*te_native)(void);
+
+
+/* Exact rational of any size. The value is in small while it fits in */
+/* 64 bits; big is only allocated once it does not. */
+typedef struct te_big {
+    Rational small;
+    struct te_bignum *big;
+} te_big;
+
+
+/* One input column for batch evaluation. */
+/* A NULL denominator means every row has denominator 1. */
+typedef struct te_column {
+    const long long *numerator;
+    const long long *denominator;
+} te_column;
+
+
 typedef struct te_variable {
     const char *name;
     const void *address;
@@ -63,6 +99,12 @@ typedef struct te_variable {
     void *context;
 } te_variable;
 
+/* A named expression, for programs. */
+typedef struct te_formula {
+    const char *name;
+    const char *expression;
+} te_formula;
+
 
 
 /* Parses the input expression, evaluates it, and frees it. */
@@ -73,9 +115,195 @@ Rational te_interp(const char *expression, int *error);
 /* Returns NULL on error. */
 te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error);
 
+/* Same as te_compile, but the whole tree is packed into one block. */
+/* Parsing and optimizing use a scratch arena instead of per-node mallocs. */
+/* Identical pure subtrees are packed once and shared, so the result is a DAG. */
+/* The result is released with a single te_free. */
+te_expr *te_compile_arena(const char *expression, const te_variable *variables, int var_count, int *error);
+
+/* Hashes the builtins and the given variables for reuse across compiles. */
+/* The variables array is referenced, not copied, and must outlive the table. */
+/* Returns NULL on allocation failure. */
+te_symbols *te_symbols_create(const te_variable *variables, int var_count);
+
+/* Same as te_compile_arena, resolving identifiers through a prebuilt table. */
+/* A table is read-only once created, so threads may share it. */
+te_expr *te_compile_symbols(const char *expression, const te_symbols *symbols, int *error);
+
+/* Frees a symbol table. Trees compiled with it stay valid. */
+/* This is safe to call on NULL pointers. */
+void te_symbols_free(te_symbols *sym);
+
+/* Creates a compile context for one set of variables: it owns their symbol */
+/* table, a scratch arena reused by every compile, and the interned values */
+/* of constant builtins. The variables array must outlive it. */
+/* Returns NULL on allocation failure. */
+te_context *te_context_create(const te_variable *variables, int var_count);
+
+/* Same as te_compile_arena, using the context's tables and scratch space. */
+/* A context serves one thread at a time; the trees it returns do not */
+/* depend on it and may outlive it. */
+te_expr *te_context_compile(te_context *ctx, const char *expression, int *error);
+
+/* Frees a context. This is safe to call on NULL pointers. */
+void te_context_free(te_context *ctx);
+
+/* Compiles count expressions as te_compile_arena would, on up to threads */
+/* threads (0 for one per processor), the caller's included. out[i] and */
+/* errors[i] (which may be NULL) receive the result and error position for */
+/* expressions[i], whatever thread compiled it. Builds without threads, or */
+/* with TE_NO_THREADS, compile serially; otherwise link with -lpthread. */
+/* Returns 0, or -1 on allocation failure with every out[i] NULL. */
+int te_compile_many(const char *const *expressions, int count, const te_variable *variables, int var_count,
+        int threads, te_expr **out, int *errors);
+
 /* Evaluates the expression. */
 Rational te_eval(const te_expr *n);
 
+/* Lowers a compiled expression to a flat instruction array. */
+/* Calls shared by a DAG are computed once per evaluation and reused. */
+/* The expression can be freed afterwards; variables stay bound. */
+/* Returns NULL on allocation failure. */
+te_bytecode *te_bytecode_compile(const te_expr *n);
+
+/* Evaluates lowered instructions without recursion. */
+Rational te_bytecode_eval(const te_bytecode *b);
+
+/* Same as te_bytecode_eval, but intermediates are left unreduced and */
+/* only normalized when they would overflow, or at the end. */
+Rational te_bytecode_eval_lazy(const te_bytecode *b);
+
+/* Frees lowered instructions. */
+/* This is safe to call on NULL pointers. */
+void te_bytecode_free(te_bytecode *b);
+
+/* Numeric backends for te_numeric_compile. */
+enum {
+    TE_EXACT,   /* Rational arithmetic, rounded to double at the end. */
+    TE_DOUBLE,  /* IEEE double throughout. */
+    TE_MIXED    /* Double, redone in Rational when the result is not finite or */
+                /* reaches 2^53, where doubles stop holding every integer. */
+};
+
+/* Lowers a compiled expression for one numeric backend. The parse and the */
+/* optimizations are the same for all of them; the backend only decides */
+/* which instructions are built and how they run. In double mode builtins */
+/* call their libm counterparts, and other functions are called with the */
+/* nearest fractions to their arguments. Variables stay Rational. */
+/* The expression can be freed afterwards; variables stay bound. */
+/* Returns NULL on allocation failure or an unknown mode. */
+te_numeric *te_numeric_compile(const te_expr *n, int mode);
+
+/* Evaluates in the backend chosen at compile. NaN when not representable, */
+/* infinities included, so that every mode agrees. */
+double te_numeric_eval(const te_numeric *num);
+
+/* This is safe to call on NULL pointers. */
+void te_numeric_free(te_numeric *num);
+
+/* Compiles to native code where supported (x86-64 with the SysV ABI), */
+/* otherwise keeps the lowered instructions for te_jit_eval to interpret. */
+/* The expression can be freed afterwards. Define TE_NO_JIT to build without it. */
+/* Returns NULL on allocation failure. */
+te_jit *te_jit_compile(const te_expr *n);
+
+/* Evaluates natively, or with te_bytecode_eval when there is no native code. */
+Rational te_jit_eval(const te_jit *j);
+
+/* The native function itself, or NULL when there is none. */
+te_native te_jit_function(const te_jit *j);
+
+/* Unmaps the code. This is safe to call on NULL pointers. */
+void te_jit_free(te_jit *j);
+
+/* Keeps the value of every subexpression between evaluations, so that */
+/* after some variables change only the paths from them to the root are */
+/* recomputed. Calls without TE_FLAG_PURE recompute every time. */
+/* The expression can be freed afterwards; variables stay bound. */
+/* Returns NULL on allocation failure. */
+te_incremental *te_incremental_create(const te_expr *n);
+
+/* Records that the variable bound at this address has changed. */
+/* NULL marks everything, as after creation. */
+void te_incremental_mark(te_incremental *inc, const Rational *bound);
+
+/* Evaluates, recomputing only what was marked since the last call. */
+Rational te_incremental_eval(te_incremental *inc);
+
+/* This is safe to call on NULL pointers. */
+void te_incremental_free(te_incremental *inc);
+
+/* Compiles named formulas into one program. A formula may use the names */
+/* of the others as variables, in any order, as long as none depends on */
+/* itself. Subterms common to several formulas are computed once. */
+/* The formula names must be distinct from each other and the variables. */
+/* Returns NULL on error, with *failed (which may be NULL) set to the formula */
+/* at fault and *error to its te_compile error position, or -1 for a name */
+/* clash or a cycle. Allocation failure leaves *failed at -1. */
+te_program *te_program_compile(const te_formula *formulas, int count, const te_variable *variables, int var_count,
+        int *failed, int *error);
+
+/* Number of formulas in the program. */
+int te_program_count(const te_program *prog);
+
+/* Evaluates every formula, writing out[i] for formulas[i]. */
+/* Returns 0, or -1 on allocation failure. */
+int te_program_eval(const te_program *prog, Rational *out);
+
+/* This is safe to call on NULL pointers. */
+void te_program_free(te_program *prog);
+
+/* Lowers expressions into one position-independent image that can be */
+/* written to a file and evaluated from it with te_image_map. Variables are */
+/* stored as their index in the variables array, functions and closures by */
+/* name and index, builtins by name. */
+/* Returns a block to free() and sets *size, or NULL on allocation failure */
+/* or if an expression uses a variable or function not in the array. */
+void *te_image_save(const te_expr *const *expressions, int count, const te_variable *variables, int var_count, size_t *size);
+
+/* Opens an image in place; data must be 8-byte aligned and outlive it. */
+/* variables supplies the functions and closures the image calls; it may */
+/* be NULL if there are none. Every instruction is checked here, so */
+/* evaluation trusts the data. */
+/* Returns NULL if the image is malformed, of another version or byte */
+/* order, or calls a function that cannot be resolved. */
+te_image *te_image_open(const void *data, size_t size, const te_variable *variables, int var_count);
+
+/* Same as te_image_open, mapping the file read-only so processes share it. */
+/* Where mmap is unavailable (or with TE_NO_MMAP) the file is read instead. */
+te_image *te_image_map(const char *path, const te_variable *variables, int var_count);
+
+/* Number of expressions in the image. */
+int te_image_count(const te_image *img);
+
+/* Evaluates expression index of the image. values[i] is the value of */
+/* variables[i] of the array the image was saved with. */
+Rational te_image_eval(const te_image *img, int index, const Rational *values);
+
+/* Closes an image, unmapping its file if it has one. */
+/* This is safe to call on NULL pointers. */
+void te_image_close(te_image *img);
+
+/* Evaluates the expression once per row. */
+/* columns[i] holds the values of variables[i], which must be the array the */
+/* expression was compiled with; other variables keep their bound value. */
+/* Column values are reduced as they are read; a zero denominator stays invalid. */
+/* Results are written to out_numerator/out_denominator (which may be NULL). */
+/* Returns 0 on success, -1 on allocation failure. */
+int te_eval_batch(const te_expr *n, const te_variable *variables, const te_column *columns, int var_count,
+        int rows, long long *out_numerator, long long *out_denominator);
+
+/* Evaluates the expression, continuing in arbitrary precision wherever */
+/* the 64-bit arithmetic would overflow. Free the result with te_big_free. */
+te_big te_eval_big(const te_expr *n);
+
+/* Writes "numerator/denominator" to buf, like snprintf: returns the length */
+/* of the whole text, even when it was cut short. -1 when out of memory. */
+int te_big_format(const te_big *v, char *buf, int size);
+
+/* Frees the limbs of a value, if any. */
+void te_big_free(te_big *v);
+
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);
 
@@ -0,0 +1,595 @@
+/*
+ * TINYEXPR - Tiny recursive descent parser and evaluation engine in C
+ *
+ * Copyright (c) 2015-2020 Lewis Van Winkle
+ *
+ * http://CodePlea.com
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software
+ * in a product, an acknowledgement in the product documentation would be
+ * appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef TINYEXPR_HPP
+#define TINYEXPR_HPP
+
+/* Formulas fixed at build time, parsed by the C++ compiler (C++20).
+ *
+ *     using gain = te::formula<"1.5*k * x / (x + 2)", "x">;
+ *     Rational r = gain::eval(x);
+ *     constexpr Rational limit = te::constant<"3.3 * 4.7*k / 2">;
+ *
+ * The string is parsed in a constant expression into a type per node, so
+ * evaluation is straight-line inlined code with no parse, no heap and no
+ * tinyexpr_5.c at run time. Subexpressions that do not depend on a variable
+ * are reduced while parsing. A formula that te_compile would reject is a
+ * compile error.
+ *
+ * The grammar, literals and SI prefixes are those of te_compile. Of the
+ * builtin functions only abs and pow are available. '^' and pow are exact
+ * for integer exponents as in the C library; other exponents, which it
+ * approximates, are not representable here. '%' takes the remainder of the
+ * quotient truncated toward zero. Results follow the
+ * C arithmetic: lowest terms, and a zero denominator when not representable. */
+
+#include "tinyexpr.h"
+#include <cstddef>
+#include <climits>
+
+namespace te {
+
+template <std::size_t N>
+struct fixed_string {
+    char text[N];
+
+    constexpr fixed_string(const char (&s)[N]) {
+        for (std::size_t i = 0; i < N; ++i) text[i] = s[i];
+    }
+
+    static constexpr std::size_t size() {return N - 1;}
+};
+
+namespace detail {
+
+/* Arithmetic. The same algorithms as tinyexpr_5.c, so results agree to the bit. */
+
+constexpr Rational overflow() {return Rational{0, 0};}
+
+constexpr bool checked_add(long long a, long long b, long long &r) {
+    if (b > 0 ? a > LLONG_MAX - b : a < LLONG_MIN - b) return true;
+    r = a + b;
+    return false;
+}
+
+constexpr bool checked_sub(long long a, long long b, long long &r) {
+    if (b < 0 ? a > LLONG_MAX + b : a < LLONG_MIN + b) return true;
+    r = a - b;
+    return false;
+}
+
+constexpr bool checked_mul(long long a, long long b, long long &r) {
+    if (a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a)
+              : (b > 0 ? a < LLONG_MIN / b : (a != 0 && b < LLONG_MAX / a))) return true;
+    r = a * b;
+    return false;
+}
+
+constexpr unsigned long long uabs(long long x) {
+    return x < 0 ? 0ULL - (unsigned long long)x : (unsigned long long)x;
+}
+
+constexpr unsigned long long ugcd(unsigned long long u, unsigned long long v) {
+    while (v) {
+        const unsigned long long t = u % v;
+        u = v;
+        v = t;
+    }
+    return u;
+}
+
+/* a + sign*b, with sign = 1 or -1. */
+constexpr Rational add_signed(Rational a, Rational b, int sign) {
+    long long num = 0, den = 0, x = 0, y = 0;
+    if (!a.denominator || !b.denominator) return overflow();
+
+    if (a.denominator == 1 && b.denominator == 1) {
+        if (sign > 0 ? checked_add(a.numerator, b.numerator, num) : checked_sub(a.numerator, b.numerator, num)) return overflow();
+        return Rational{num, 1};
+    }
+
+    const unsigned long long g = ugcd(uabs(a.denominator), uabs(b.denominator));
+    const long long ad = a.denominator / (long long)g, bd = b.denominator / (long long)g;
+    if (checked_mul(a.numerator, bd, x)) return overflow();
+    if (checked_mul(b.numerator, ad, y)) return overflow();
+    if (sign > 0 ? checked_add(x, y, num) : checked_sub(x, y, num)) return overflow();
+    const unsigned long long h = g == 1 ? 1 : ugcd(uabs(num), g);
+    if (h > 1) num /= (long long)h;
+    if (checked_mul(ad, b.denominator / (long long)h, den)) return overflow();
+    if (!num) den = 1;
+    return Rational{num, den};
+}
+
+constexpr Rational add(Rational a, Rational b) {return add_signed(a, b, 1);}
+constexpr Rational sub(Rational a, Rational b) {return add_signed(a, b, -1);}
+
+constexpr Rational mul(Rational a, Rational b) {
+    long long num = 0, den = 0;
+    if (!a.denominator || !b.denominator) return overflow();
+    if (a.denominator == 1 && b.denominator == 1) {
+        if (checked_mul(a.numerator, b.numerator, num)) return overflow();
+        return Rational{num, 1};
+    }
+    const unsigned long long g1 = ugcd(uabs(a.numerator), uabs(b.denominator));
+    const unsigned long long g2 = ugcd(uabs(b.numerator), uabs(a.denominator));
+    if (g1 > 1) {a.numerator /= (long long)g1; b.denominator /= (long long)g1;}
+    if (g2 > 1) {b.numerator /= (long long)g2; a.denominator /= (long long)g2;}
+    if (checked_mul(a.numerator, b.numerator, num)) return overflow();
+    if (checked_mul(a.denominator, b.denominator, den)) return overflow();
+    if (!num) den = 1;
+    return Rational{num, den};
+}
+
+constexpr Rational divide(Rational a, Rational b) {
+    if (!b.numerator || !b.denominator) return overflow();
+    if (b.numerator == LLONG_MIN || b.denominator == LLONG_MIN) return overflow();
+    return mul(a, Rational{b.numerator < 0 ? -b.denominator : b.denominator,
+                           b.numerator < 0 ? -b.numerator : b.numerator});
+}
+
+constexpr Rational negate(Rational a) {
+    if (a.numerator == LLONG_MIN) return overflow();
+    return Rational{-a.numerator, a.denominator};
+}
+
+constexpr Rational absolute(Rational a) {
+    return a.numerator < 0 ? negate(a) : a;
+}
+
+/* a^b by squaring; b must be an integer. */
+constexpr Rational power(Rational a, Rational b) {
+    if (!a.denominator || b.denominator != 1) return overflow();
+    Rational result{1, 1};
+    unsigned long long e = uabs(b.numerator);
+    for (; e; e >>= 1) {
+        if (e & 1) result = mul(result, a);
+        if (e > 1) a = mul(a, a);
+        if (!result.denominator || !a.denominator) return overflow();
+    }
+    return b.numerator < 0 ? divide(Rational{1, 1}, result) : result;
+}
+
+/* a - b*trunc(a/b). */
+constexpr Rational modulo(Rational a, Rational b) {
+    const Rational q = divide(a, b);
+    if (!q.denominator) return overflow();
+    return sub(a, mul(b, Rational{q.numerator / q.denominator, 1}));
+}
+
+/* Literals, as scan_number and scale10 read them. */
+
+constexpr int max_exponent = 100000;
+
+constexpr Rational scale10(unsigned long long digits, int exponent) {
+    long long num = 0, den = 1;
+    int twos = exponent < 0 && digits ? -exponent : 0, fives = twos;
+    for (; twos && !(digits & 1); --twos) digits >>= 1;
+    for (; fives && digits % 5 == 0; --fives) digits /= 5;
+    if (digits > LLONG_MAX) return overflow();
+    num = (long long)digits;
+    for (; exponent > 0; --exponent) {
+        if (checked_mul(num, 10, num)) return overflow();
+    }
+    for (; twos; --twos) {
+        if (checked_mul(den, 2, den)) return overflow();
+    }
+    for (; fives; --fives) {
+        if (checked_mul(den, 5, den)) return overflow();
+    }
+    return Rational{num, den};
+}
+
+struct builtin {
+    const char *name;
+    Rational value;
+};
+
+/* The SI prefixes of tinyexpr_5.c; the ones past 64 bits are not representable. */
+constexpr builtin prefixes[] = {
+    {"E", {1000000000000000000, 1}}, {"G", {1000000000, 1}}, {"M", {1000000, 1}},
+    {"Mhz", {1000000, 1}}, {"P", {1000000000000000, 1}}, {"T", {1000000000000, 1}},
+    {"Y", {0, 0}}, {"Z", {0, 0}}, {"a", {1, 1000000000000000000}},
+    {"c", {1, 100}}, {"d", {1, 10}}, {"da", {10, 1}},
+    {"f", {1, 1000000000000000}}, {"h", {100, 1}}, {"k", {1000, 1}},
+    {"m", {1, 1000}}, {"n", {1, 1000000000}}, {"p", {1, 1000000000000}},
+    {"u", {1, 1000000}}, {"y", {0, 0}}, {"z", {0, 0}},
+};
+
+/* Parsed form. Nodes are stored children first; lhs and rhs index them. */
+
+enum class op : unsigned char {constant, variable, add, sub, mul, divide, modulo, power, negate, abs, comma};
+
+struct node {
+    op code;
+    int lhs, rhs;       /* Operands, or the variable's index. */
+    Rational value;
+};
+
+template <std::size_t N>
+struct program {
+    node nodes[N];
+    int count;
+    int root;
+    int error;          /* As te_compile reports it: 1-based position, 0 on success. */
+};
+
+constexpr Rational apply(op code, Rational a, Rational b) {
+    switch (code) {
+        case op::add: return add(a, b);
+        case op::sub: return sub(a, b);
+        case op::mul: return mul(a, b);
+        case op::divide: return divide(a, b);
+        case op::modulo: return modulo(a, b);
+        case op::power: return power(a, b);
+        case op::negate: return negate(a);
+        case op::abs: return absolute(a);
+        case op::comma: return b;
+        default: return overflow();
+    }
+}
+
+constexpr bool is_alpha(char c) {return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');}
+constexpr bool is_digit(char c) {return c >= '0' && c <= '9';}
+
+constexpr bool same_name(const char *a, const char *name, int len) {
+    for (int i = 0; i < len; ++i) {
+        if (a[i] != name[i]) return false;
+    }
+    return a[len] == '\0';
+}
+
+/* The recursive descent of tinyexpr_5.c over a node array. A node whose
+ * operands are all constants is replaced by its value as it is built. */
+template <std::size_t N>
+struct parser {
+    enum token {END, ERROR, NUMBER, VARIABLE, PREFIX, ABS, POW, INFIX, OPEN, CLOSE, SEP};
+
+    const char *start, *next;
+    const char *const *names;
+    int name_count;
+    program<N> out{};
+    token type = END;
+    char infix = 0;
+    Rational value{};
+    int variable = 0;
+
+    constexpr int emit(op code, int lhs, int rhs, Rational v = Rational{0, 1}) {
+        if (out.count == (int)N) {
+            type = ERROR;
+            return 0;
+        }
+        if (code != op::constant && code != op::variable) {
+            const bool unary = code == op::negate || code == op::abs;
+            if (out.nodes[lhs].code == op::constant && (unary || out.nodes[rhs].code == op::constant)) {
+                v = apply(code, out.nodes[lhs].value, unary ? Rational{0, 1} : out.nodes[rhs].value);
+                code = op::constant;
+            }
+        }
+        out.nodes[out.count] = node{code, lhs, rhs, v};
+        return out.count++;
+    }
+
+    constexpr void next_token() {
+        type = END;
+        for (;;) {
+            if (!*next) {
+                type = END;
+                return;
+            }
+            if (is_digit(*next) || *next == '.') {
+                scan_number();
+                return;
+            }
+            if (is_alpha(*next)) {
+                const char *id = next;
+                while (is_alpha(*next) || is_digit(*next) || *next == '_') ++next;
+                lookup(id, (int)(next - id));
+                return;
+            }
+            const char c = *next++;
+            switch (c) {
+                case '+': case '-': case '*': case '/': case '^': case '%':
+                    type = INFIX; infix = c; return;
+                case '(': type = OPEN; return;
+                case ')': type = CLOSE; return;
+                case ',': type = SEP; return;
+                case ' ': case '\t': case '\n': case '\r': break;
+                default: type = ERROR; return;
+            }
+        }
+    }
+
+    constexpr void scan_number() {
+        unsigned long long num = 0;
+        int zeros = 0, scale = 0;
+        for (;; ++next) {
+            if (*next == '.') {
+                if (scale) break;
+                scale = -1;
+                continue;
+            }
+            if (!is_digit(*next)) break;
+            const int d = *next - '0';
+            if (scale) --scale;
+            if (d == 0) {
+                if (num) ++zeros;
+                continue;
+            }
+            for (; zeros >= 0; --zeros) {
+                if (num > ULLONG_MAX / 10) {type = ERROR; return;}
+                num *= 10;
+            }
+            zeros = 0;
+            if (num > ULLONG_MAX - d) {type = ERROR; return;}
+            num += d;
+        }
+        if (scale) ++scale;
+
+        const char *q = next;
+        if (*q == 'e' || *q == 'E') {
+            int sign = 1, e = 0;
+            ++q;
+            if (*q == '+' || *q == '-') sign = *q++ == '-' ? -1 : 1;
+            if (is_digit(*q)) {
+                for (; is_digit(*q); ++q) {
+                    if (e < max_exponent) e = e * 10 + (*q - '0');
+                }
+                scale += sign * (e < max_exponent ? e : max_exponent);
+                next = q;
+            }
+        }
+        value = scale10(num, num ? scale + zeros : 0);
+        type = !value.denominator && num > LLONG_MAX ? ERROR : NUMBER;
+    }
+
+    constexpr void lookup(const char *id, int len) {
+        for (int i = 0; i < name_count; ++i) {
+            if (same_name(names[i], id, len)) {
+                type = VARIABLE;
+                variable = i;
+                return;
+            }
+        }
+        for (const builtin &b : prefixes) {
+            if (same_name(b.name, id, len)) {
+                type = PREFIX;
+                value = b.value;
+                return;
+            }
+        }
+        if (same_name("abs", id, len)) type = ABS;
+        else if (same_name("pow", id, len)) type = POW;
+        else type = ERROR;
+    }
+
+    constexpr int fail() {
+        type = ERROR;
+        return emit(op::constant, 0, 0, overflow());
+    }
+
+    constexpr int base() {
+        int ret = 0;
+        switch (type) {
+            case NUMBER:
+                ret = emit(op::constant, 0, 0, value);
+                next_token();
+                return ret;
+
+            case VARIABLE:
+                ret = emit(op::variable, variable, 0);
+                next_token();
+                return ret;
+
+            case PREFIX:
+                ret = emit(op::constant, 0, 0, value);
+                next_token();
+                if (type == OPEN) {
+                    next_token();
+                    if (type != CLOSE) type = ERROR;
+                    else next_token();
+                }
+                return ret;
+
+            case ABS:
+                next_token();
+                return emit(op::abs, power(), 0);
+
+            case POW: {
+                next_token();
+                if (type != OPEN) return fail();
+                next_token();
+                const int lhs = expr();
+                if (type != SEP) return fail();
+                next_token();
+                const int rhs = expr();
+                if (type != CLOSE) return fail();
+                next_token();
+                return emit(op::power, lhs, rhs);
+            }
+
+            case OPEN:
+                next_token();
+                ret = list();
+                if (type != CLOSE) type = ERROR;
+                else next_token();
+                return ret;
+
+            default:
+                return fail();
+        }
+    }
+
+    constexpr bool at_infix(char a, char b = 0, char c = 0) const {
+        return type == INFIX && (infix == a || infix == b || infix == c);
+    }
+
+    constexpr int signs() {
+        int sign = 1;
+        while (at_infix('+', '-')) {
+            if (infix == '-') sign = -sign;
+            next_token();
+        }
+        return sign;
+    }
+
+    constexpr int power() {
+        const int sign = signs();
+        const int ret = base();
+        return sign == 1 ? ret : emit(op::negate, ret, 0);
+    }
+
+    constexpr int factor() {
+#ifdef TE_POW_FROM_RIGHT
+        /* A leading minus applies to the whole chain: -a^b is -(a^b). */
+        const int sign = signs();
+        int ret = base();
+        if (at_infix('^')) {
+            next_token();
+            ret = emit(op::power, ret, factor_operand());
+        }
+        return sign == 1 ? ret : emit(op::negate, ret, 0);
+#else
+        int ret = power();
+        while (at_infix('^')) {
+            next_token();
+            ret = emit(op::power, ret, power());
+        }
+        return ret;
+#endif
+    }
+
+#ifdef TE_POW_FROM_RIGHT
+    /* The right-hand side of a right-to-left chain: a ^ (b ^ (c ...)). */
+    constexpr int factor_operand() {
+        const int ret = power();
+        if (!at_infix('^')) return ret;
+        next_token();
+        return emit(op::power, ret, factor_operand());
+    }
+#endif
+
+    constexpr int term() {
+        int ret = factor();
+        while (at_infix('*', '/', '%')) {
+            const op code = infix == '*' ? op::mul : infix == '/' ? op::divide : op::modulo;
+            next_token();
+            ret = emit(code, ret, factor());
+        }
+        return ret;
+    }
+
+    constexpr int expr() {
+        int ret = term();
+        while (at_infix('+', '-')) {
+            const op code = infix == '+' ? op::add : op::sub;
+            next_token();
+            ret = emit(code, ret, term());
+        }
+        return ret;
+    }
+
+    constexpr int list() {
+        int ret = expr();
+        while (type == SEP) {
+            next_token();
+            ret = emit(op::comma, ret, expr());
+        }
+        return ret;
+    }
+
+    constexpr program<N> parse() {
+        next_token();
+        out.root = list();
+        if (type != END) {
+            out.error = (int)(next - start);
+            if (!out.error) out.error = 1;
+        }
+        return out;
+    }
+};
+
+/* Every token makes at most one node, and each takes at least one character. */
+template <fixed_string Expression, fixed_string... Variables>
+constexpr program<Expression.size() + 1> parse() {
+    const char *names[] = {Variables.text..., nullptr};
+    parser<Expression.size() + 1> p{Expression.text, Expression.text, names, (int)sizeof...(Variables)};
+    return p.parse();
+}
+
+template <int Position>
+constexpr bool syntax_error_at = Position != 0;
+
+/* One type per node: evaluation is a tree of inlined calls fixed at compile time. */
+template <const auto &Program, int Index>
+struct expr {
+    static constexpr node self = Program.nodes[Index];
+    using lhs = expr<Program, self.code == op::constant || self.code == op::variable ? Index : self.lhs>;
+    using rhs = expr<Program, self.code == op::negate || self.code == op::abs || self.code == op::constant || self.code == op::variable ? Index : self.rhs>;
+
+    static constexpr Rational eval(const Rational *values) {
+        if constexpr (self.code == op::constant) {
+            return self.value;
+        } else if constexpr (self.code == op::variable) {
+            return values[self.lhs];
+        } else if constexpr (self.code == op::comma) {
+            return rhs::eval(values);
+        } else if constexpr (self.code == op::negate || self.code == op::abs) {
+            return apply(self.code, lhs::eval(values), Rational{0, 1});
+        } else {
+            return apply(self.code, lhs::eval(values), rhs::eval(values));
+        }
+    }
+};
+
+} /* namespace detail */
+
+/* A formula over the named variables, which eval takes in the same order. */
+template <fixed_string Expression, fixed_string... Variables>
+struct formula {
+    static constexpr auto program = detail::parse<Expression, Variables...>();
+    static_assert(!detail::syntax_error_at<program.error>, "te::formula: syntax error; the position is the argument of syntax_error_at");
+
+    using tree = detail::expr<program, program.root>;
+
+    template <class... Values>
+        requires (sizeof...(Values) == sizeof...(Variables))
+    static constexpr Rational eval(const Values &... values) {
+        const Rational bound[] = {values..., Rational{0, 1}};
+        return tree::eval(bound);
+    }
+
+    template <class... Values>
+        requires (sizeof...(Values) == sizeof...(Variables))
+    constexpr Rational operator()(const Values &... values) const {
+        return eval(values...);
+    }
+};
+
+/* The value of a formula without variables. */
+template <fixed_string Expression>
+inline constexpr Rational constant = formula<Expression>::eval();
+
+} /* namespace te */
+
+#endif /*TINYEXPR_HPP*/
@@ -34,6 +34,12 @@ For log = base 10 log do nothing
 For log = natural log uncomment the next line. */
 /* #define TE_NAT_LOG */
 
+/* Approximations
+Builtins without an exact rational result, like sin(1) or sqrt(2), give the
+nearest fraction with a denominator of at most TE_APPROX_DENOMINATOR.
+A smaller bound leaves more headroom for the arithmetic that follows. */
+/* #define TE_APPROX_DENOMINATOR 1000000000LL */
+
 #include "tinyexpr.h"
 #include <stdlib.h>
 #include <math.h>
@@ -41,31 +47,118 @@ For log = natural log uncomment the next line. */
 #include <stdio.h>
 #include <ctype.h>
 #include <limits.h>
+#include <float.h>
+
+/* Checked 64-bit arithmetic. Each returns nonzero instead of wrapping. */
+#if defined(__GNUC__) || defined(__clang__)
+#define checked_add(a, b, r) __builtin_add_overflow((a), (b), (r))
+#define checked_sub(a, b, r) __builtin_sub_overflow((a), (b), (r))
+#define checked_mul(a, b, r) __builtin_mul_overflow((a), (b), (r))
+#define CTZ(x) __builtin_ctzll(x)
+#else
+static int checked_add(long long a, long long b, long long *r) {
+    if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b)) return 1;
+    *r = a + b;
+    return 0;
+}
+
+static int checked_sub(long long a, long long b, long long *r) {
+    if ((b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b)) return 1;
+    *r = a - b;
+    return 0;
+}
+
+static int checked_mul(long long a, long long b, long long *r) {
+    if (a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a)
+              : (b > 0 ? a < LLONG_MIN / b : (a != 0 && b < LLONG_MAX / a))) return 1;
+    *r = a * b;
+    return 0;
+}
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static int CTZ(unsigned long long x) {
+    unsigned long i;
+#if defined(_M_X64) || defined(_M_ARM64)
+    _BitScanForward64(&i, x);
+#else
+    if (!_BitScanForward(&i, (unsigned long)x)) {
+        _BitScanForward(&i, (unsigned long)(x >> 32));
+        i += 32;
+    }
+#endif
+    return (int)i;
+}
+#else
+static int CTZ(unsigned long long x) {
+    int i = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        ++i;
+    }
+    return i;
+}
+#endif
+#endif
+
+static unsigned long long uabs(long long x) {
+    return x < 0 ? 0ULL - (unsigned long long)x : (unsigned long long)x;
+}
+
+/* Binary GCD: shifts and subtractions instead of a division per step. */
+static unsigned long long ugcd(unsigned long long u, unsigned long long v) {
+    int shift;
+    if (!u) return v;
+    if (!v) return u;
+    shift = CTZ(u | v);
+    u >>= CTZ(u);
+    do {
+        v >>= CTZ(v);
+        if (u > v) {
+            unsigned long long t = u;
+            u = v;
+            v = t;
+        }
+        v -= u;
+    } while (v);
+    return u << shift;
+}
 
 long long gcd( long long a, long long b)
 {
-    long long temp;
-    while (b != 0)
-    {
-        temp = a % b;
+    return (long long)ugcd(uabs(a), uabs(b));
+}
 
-        a = b;
-        b = temp;
+/* Not representable: overflow, or division by zero. */
+static Rational ROVERFLOW(){Rational r; r.numerator = 0; r.denominator = 0; return r;}
+
+/* Divides out the common factor and keeps the sign on the numerator. */
+static Rational reduce(long long num, long long den) {
+    Rational result;
+    unsigned long long g;
+    if (den == 0) return ROVERFLOW();
+    if (den != 1) {
+        g = ugcd(uabs(num), uabs(den));
+        if (g > 1) {
+            num /= (long long)g;
+            den /= (long long)g;
+        }
+        if (den < 0) {
+            if (num == LLONG_MIN || den == LLONG_MIN) return ROVERFLOW();
+            num = -num;
+            den = -den;
+        }
     }
-    return a;
+    result.numerator = num;
+    result.denominator = den;
+    return result;
 }
 
 Rational Fraction(long long n, long long d){
-		long long gcd_val;
-	    Rational result;
-		gcd_val = gcd(n,d);
-		result.numerator   = n/gcd_val;
-		result.denominator = d/gcd_val;
-		return result;
+		return reduce(n, d);
 }
 
-static Rational RNAN(){return Fraction(-1,1);}
-static Rational RINFINITY(){return Fraction(-1000000000000000,1);} 
+static Rational RNAN(){return ROVERFLOW();}
 
 typedef Rational (*te_fun2)(Rational, Rational);
 
@@ -78,6 +171,13 @@ enum {
 enum {TE_CONSTANT = 1};
 
 
+typedef struct te_arena {
+    char *base;         /* Block currently being carved up. */
+    size_t used, size;
+    void *spill;        /* Heap blocks, newest first. */
+} te_arena;
+
+
 typedef struct state {
     const char *start;
     const char *next;
@@ -87,6 +187,12 @@ typedef struct state {
 
     const te_variable *lookup;
     int lookup_len;
+
+    te_arena *arena; /* Scratch nodes come from here when set, otherwise from malloc. */
+    const te_symbols *symbols; /* Replaces lookup and the builtin search when set. */
+    const Rational *constants; /* Interned builtin values, parallel to functions[]; denominator 0 if not. */
+    const Rational *interned;  /* Value of the current arity-0 builtin token, if interned. */
+    int exponent;    /* Power of ten a TOK_NUMBER value still needs, when applying it overflowed. */
 } state;
 
 
@@ -96,13 +202,47 @@ typedef struct state {
 #define IS_FUNCTION(TYPE) (((TYPE) & TE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TE_CLOSURE0) != 0)
 #define ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
-#define NEW_EXPR(type, ...) new_expr((type), (const te_expr*[]){__VA_ARGS__})
+#define NEW_EXPR(s, type, ...) new_expr((s), (type), (const te_expr*[]){__VA_ARGS__})
+#define TE_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+/* Bytes used by a node of the given type, padded so nodes can be packed back to back. */
+static size_t node_size(const int type) {
+    const size_t psize = sizeof(void*) * ARITY(type);
+    return TE_ALIGN((sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0));
+}
+
+static void *arena_alloc(te_arena *a, size_t size) {
+    void *ret;
+    size = TE_ALIGN(size);
+    if (a->used + size > a->size) {
+        /* Chain a new block; the first word of each heap block links to the previous one. */
+        size_t block = a->size * 2 > size ? a->size * 2 : size;
+        char *b = malloc(TE_ALIGN(sizeof(void*)) + block);
+        if (!b) return 0;
+        *(void**)b = a->spill;
+        a->spill = b;
+        a->base = b + TE_ALIGN(sizeof(void*));
+        a->size = block;
+        a->used = 0;
+    }
+    ret = a->base + a->used;
+    a->used += size;
+    return ret;
+}
+
+static void arena_release(te_arena *a) {
+    while (a->spill) {
+        void *prev = *(void**)a->spill;
+        free(a->spill);
+        a->spill = prev;
+    }
+}
 
-static te_expr *new_expr(const int type, const te_expr *parameters[]) {
+static te_expr *new_expr(state *s, const int type, const te_expr *parameters[]) {
     const int arity = ARITY(type);
     const int psize = sizeof(void*) * arity;
-    const int size = (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
-    te_expr *ret = malloc(size);
+    const int size = node_size(type);
+    te_expr *ret = s->arena ? arena_alloc(s->arena, size) : malloc(size);
     memset(ret, 0, size);
     if (arity && parameters) {
         memcpy(ret->parameters, parameters, psize);
@@ -129,7 +269,8 @@ void te_free_parameters(te_expr *n) {
 
 void te_free(te_expr *n) {
     if (!n) return;
-    te_free_parameters(n);
+    /* Packed trees keep every node inside the root's block. */
+    if (!(n->type & TE_FLAG_ARENA)) te_free_parameters(n);
     free(n);
 }
 
@@ -157,84 +298,107 @@ void te_free(te_expr *n) {
 */
 
 #define Yacto 10000000000000000000
+
+/* Operands are expected in lowest terms with a positive denominator, which is
+ * also the form every result takes. That lets the common integer case skip
+ * the gcd entirely and lets mul/divide cancel before multiplying. */
+
+/* a + sign*b, with sign = 1 or -1. */
+static Rational add_signed(Rational a, Rational b, int sign) {
+    long long num, den, x, y, ad, bd;
+    unsigned long long g, h;
+    if (!a.denominator || !b.denominator) return ROVERFLOW();
+
+    if (a.denominator == 1 && b.denominator == 1) {
+        if (sign > 0 ? checked_add(a.numerator, b.numerator, &num) : checked_sub(a.numerator, b.numerator, &num)) return ROVERFLOW();
+        a.numerator = num;
+        return a;
+    }
+
+    /* Work over the lcm of the denominators (Knuth 4.5.1): the result can
+     * only share a factor with g = gcd(ad, bd), so when g is 1 it is already
+     * in lowest terms. */
+    g = ugcd(uabs(a.denominator), uabs(b.denominator));
+    ad = a.denominator / (long long)g;
+    bd = b.denominator / (long long)g;
+    if (checked_mul(a.numerator, bd, &x)) return ROVERFLOW();
+    if (checked_mul(b.numerator, ad, &y)) return ROVERFLOW();
+    if (sign > 0 ? checked_add(x, y, &num) : checked_sub(x, y, &num)) return ROVERFLOW();
+    h = g == 1 ? 1 : ugcd(uabs(num), g);
+    if (h > 1) num /= (long long)h;
+    if (checked_mul(ad, b.denominator / (long long)h, &den)) return ROVERFLOW();
+    if (!num) den = 1;
+    a.numerator = num;
+    a.denominator = den;
+    return a;
+}
+
 Rational add( Rational a,  Rational b){
-	 long long num;
-	 long long den;
-	 long long gcd_val;
-	 Rational  result;
-	
-	num = a.numerator*b.denominator+b.numerator*a.denominator;
-	den = a.denominator * b.denominator;
-	gcd_val = gcd(num,den);
-	result.numerator   = num/gcd_val;
-	result.denominator = den/gcd_val;
-	return result;
+	return add_signed(a, b, 1);
 }
     Rational sub ( Rational a, Rational b){
-       long long num;
-       long long den;
-       long long gcd_val;
-        Rational result;
-       num = a.numerator*b.denominator-b.numerator*a.denominator;
-	   den = a.denominator * b.denominator;
-	   gcd_val = gcd(num,den);
-	   result.numerator   = num/gcd_val;
-	   result.denominator = den/gcd_val;
-	   return result;
+	   return add_signed(a, b, -1);
 }
 Rational mul(Rational a,Rational b){
        long long num;
        long long den;
-       long long gcd_val;
-        Rational result;
-       num = a.numerator*b.numerator;
-	   den = a.denominator * b.denominator;
-	   gcd_val = gcd(num,den);
-	   result.numerator   = num/gcd_val;
-	   result.denominator = den/gcd_val;
-	   return result;
+       unsigned long long g1, g2;
+       if (!a.denominator || !b.denominator) return ROVERFLOW();
+       if (a.denominator == 1 && b.denominator == 1) {
+           if (checked_mul(a.numerator, b.numerator, &num)) return ROVERFLOW();
+           a.numerator = num;
+           return a;
+       }
+       /* Cross-cancel so the products are already in lowest terms. */
+       g1 = ugcd(uabs(a.numerator), uabs(b.denominator));
+       g2 = ugcd(uabs(b.numerator), uabs(a.denominator));
+       if (g1 > 1) { a.numerator /= (long long)g1; b.denominator /= (long long)g1; }
+       if (g2 > 1) { b.numerator /= (long long)g2; a.denominator /= (long long)g2; }
+       if (checked_mul(a.numerator, b.numerator, &num)) return ROVERFLOW();
+       if (checked_mul(a.denominator, b.denominator, &den)) return ROVERFLOW();
+       if (!num) den = 1;
+       a.numerator = num;
+       a.denominator = den;
+	   return a;
 }
 Rational divide(Rational a,Rational b){
-       long long num;
-       long long den;
-       long long gcd_val;
-        Rational result;
-       num = a.numerator*b.denominator;
-	   den = a.denominator * b.numerator;
-	   gcd_val = gcd(num,den);
-	   result.numerator   = num/gcd_val;
-	   result.denominator = den/gcd_val;
-	   return result;
+       Rational inverse;
+       if (!b.numerator || !b.denominator) return ROVERFLOW();
+       if (b.numerator == LLONG_MIN || b.denominator == LLONG_MIN) return ROVERFLOW();
+       inverse.numerator = b.numerator < 0 ? -b.denominator : b.denominator;
+       inverse.denominator = b.numerator < 0 ? -b.numerator : b.numerator;
+	   return mul(a, inverse);
 }
 
 Rational tenpow(Rational a,Rational b){
-       long long num;
-       long long den;
-       long long gcd_val;
-       Rational result;
-		if (b.denominator == 1){
-			//printf("DEBUG: power of fraction\n");
-		   num = a.numerator*(long long)pow(10,b.numerator);
-		   den = a.denominator ;
-		   gcd_val = gcd(num,den);
-		   result.numerator   = num/gcd_val;
-		   result.denominator = den/gcd_val;
+       Rational scale;
+       unsigned long long i;
+		if (b.denominator != 1){
+			/* Cannot handle power of fraction */
+			return ROVERFLOW();
 		}
-		else{
-			//printf("ERROR: Cannot handle power of fraction\n");
+		/* Zero stays zero however large the exponent. */
+		if (a.numerator == 0 && a.denominator) return a;
+		scale.numerator = 1;
+		scale.denominator = 1;
+		for (i = uabs(b.numerator); i > 0; --i) {
+			if (checked_mul(scale.numerator, 10, &scale.numerator)) return ROVERFLOW();
 		}
-	   return result;
+	   return b.numerator < 0 ? divide(a, scale) : mul(a, scale);
 }
 Rational negate(Rational a){
         Rational result;
+		if (a.numerator == LLONG_MIN) return ROVERFLOW();
 		result.numerator = -a.numerator;
 		result.denominator = a.denominator;
 		return result;
 }
 
-//static Rational y(void) {return Fraction(1,1000000000000000000000000);}//yocto
-//static Rational z(void) {return Fraction(1,1000000000000000000);}//zepto
-//static Rational f(void) {return Fraction(1,1000000000000000);}//femto
+/* Prefixes past 64 bits have no Rational value; te_eval_big supplies them. */
+static Rational y(void) {return ROVERFLOW();}//yocto
+static Rational z(void) {return ROVERFLOW();}//zepto
+static Rational a(void) {return Fraction(1,1000000000000000000);}//atto
+static Rational f(void) {return Fraction(1,1000000000000000);}//femto
 static Rational p(void) {return Fraction(1,1000000000000);}//pico
 static Rational n(void) {return Fraction(1,1000000000);}//nano
 static Rational u(void) {return Fraction(1,1000000);}//micro
@@ -247,116 +411,251 @@ static Rational k(void) {return Fraction(1000,1);}//kilo
 static Rational M(void) {return Fraction(1000000,1);}//mega
 static Rational Mhz(void) {return Fraction(1000000,1);}//mega
 static Rational G(void) {return Fraction(1000000000,1);}//giga
-static Rational T(void) {return Fraction(100000000000,1);}//tera
-static Rational P(void) {return Fraction(100000000000000,1);}//peta
-//static Rational E(void) {return Fraction(1000000000000000000,1);}//exa
-//static Rational Y(void) {return Fraction(1000000000000000000000000,1);}//yotta
-//static Rational Z(void) {return Fraction(1000000000000000000000,1);}//zetto
-
-
-static Rational fac(Rational a) {/* simplest version of fac */
-    if (a.numerator < 0.0)
-        return RNAN();
-    if (a.numerator > UINT_MAX)
-        return RINFINITY();
-    unsigned int ua = (unsigned int)(a.numerator);
-    unsigned long int result = 1, i;
-    for (i = 1; i <= ua; i++) {
-        if (i > ULONG_MAX / result)
-            return RINFINITY();
-        result *= i;
-    }
-    return Fraction(result,1);
+static Rational T(void) {return Fraction(1000000000000,1);}//tera
+static Rational P(void) {return Fraction(1000000000000000,1);}//peta
+static Rational E(void) {return Fraction(1000000000000000000,1);}//exa
+static Rational Y(void) {return ROVERFLOW();}//yotta
+static Rational Z(void) {return ROVERFLOW();}//zetta
+
+
+/* Builtins. Those with exact rational values are computed exactly; the rest
+ * go through double and come back as the continued-fraction convergent
+ * nearest to the double result, with a denominator no larger than
+ * TE_APPROX_DENOMINATOR. Values outside a function's domain are RNAN. */
+
+#ifndef TE_APPROX_DENOMINATOR
+#define TE_APPROX_DENOMINATOR 1000000000LL
+#endif
+
+static double to_double(Rational a) {
+    return a.denominator ? (double)a.numerator / (double)a.denominator : NAN;
+}
+
+/* Expands x as a continued fraction until a convergent is within double
+ * precision of it. Past the denominator bound, the best semiconvergent that
+ * still fits is taken. */
+static Rational approximate(double x) {
+    long long p0 = 0, q0 = 1, p1 = 1, q1 = 0, p2, q2, t;
+    double v = x;
+
+    if (!(fabs(x) < 9.2e18)) return RNAN();
+    for (;;) {
+        const double a = floor(v);
+        if (fabs(a) >= 9.2e18 || checked_mul((long long)a, p1, &p2) || checked_add(p2, p0, &p2)
+                || checked_mul((long long)a, q1, &q2) || checked_add(q2, q0, &q2) || q2 > TE_APPROX_DENOMINATOR) {
+            if (!q1) return RNAN();
+            t = (TE_APPROX_DENOMINATOR - q0) / q1;
+            if (t > 0 && !checked_mul(t, p1, &p2) && !checked_add(p2, p0, &p2) && !checked_mul(t, q1, &q2) && !checked_add(q2, q0, &q2)
+                    && fabs(x - (double)p2 / (double)q2) < fabs(x - (double)p1 / (double)q1)) {
+                p1 = p2;
+                q1 = q2;
+            }
+            break;
+        }
+        p0 = p1; q0 = q1;
+        p1 = p2; q1 = q2;
+        if (v == a || fabs(x - (double)p1 / (double)q1) <= fabs(x) * DBL_EPSILON) break;
+        v = 1 / (v - a);
+    }
+    return reduce(p1, q1);
+}
+
+/* Whether r^k > v, without overflowing. */
+static int power_exceeds(unsigned long long r, int k, unsigned long long v) {
+    unsigned long long p = 1;
+    while (k--) {
+        if (r && p > v / r) return 1;
+        p *= r;
+    }
+    return p > v;
+}
+
+/* Largest r with r^k <= v: the double estimate, corrected. */
+static unsigned long long iroot(unsigned long long v, int k) {
+    unsigned long long r = (unsigned long long)pow((double)v, 1.0 / k);
+    while (r && power_exceeds(r, k, v)) --r;
+    while (!power_exceeds(r + 1, k, v)) ++r;
+    return r;
+}
+
+/* The exact k-th root of a, if it is rational. */
+static int exact_root(Rational a, int k, Rational *root) {
+    const unsigned long long n = uabs(a.numerator), d = (unsigned long long)a.denominator;
+    const unsigned long long rn = iroot(n, k), rd = iroot(d, k);
+    unsigned long long pn = 1, pd = 1;
+    int i;
+    if (a.numerator < 0 && k % 2 == 0) return 0;
+    for (i = 0; i < k; ++i) {
+        pn *= rn;
+        pd *= rd;
+    }
+    if (pn != n || pd != d) return 0;
+    root->numerator = a.numerator < 0 ? -(long long)rn : (long long)rn;
+    root->denominator = (long long)rd;
+    return 1;
+}
+
+/* a^b. Integer exponents go by squaring; p/q exponents are exact when a has
+ * a rational q-th root. */
+static Rational rpow(Rational a, Rational b) {
+    Rational result = {1, 1}, root;
+    unsigned long long e;
+    if (!a.denominator || !b.denominator) return RNAN();
+    if (b.denominator != 1) {
+        if (b.denominator <= 64 && exact_root(a, (int)b.denominator, &root)) {
+            b.denominator = 1;
+            return rpow(root, b);
+        }
+        if (a.numerator < 0) return RNAN();
+        return approximate(pow(to_double(a), to_double(b)));
+    }
+    for (e = uabs(b.numerator); e; e >>= 1) {
+        if (e & 1) result = mul(result, a);
+        if (e > 1) a = mul(a, a);
+        if (!result.denominator || !a.denominator) return ROVERFLOW();
+    }
+    return b.numerator < 0 ? divide(Fraction(1, 1), result) : result;
+}
+
+/* a - b*trunc(a/b), which keeps the sign of a like fmod. */
+static Rational rmod(Rational a, Rational b) {
+    const Rational q = divide(a, b);
+    if (!q.denominator) return RNAN();
+    return sub(a, mul(b, Fraction(q.numerator / q.denominator, 1)));
+}
+
+static Rational rabs(Rational a) {return a.numerator < 0 ? negate(a) : a;}
+
+static Rational rfloor(Rational a) {
+    if (!a.denominator) return RNAN();
+    a.numerator = a.numerator / a.denominator - (a.numerator % a.denominator < 0);
+    a.denominator = 1;
+    return a;
+}
+
+static Rational rceil(Rational a) {
+    if (!a.denominator) return RNAN();
+    a.numerator = a.numerator / a.denominator + (a.numerator % a.denominator > 0);
+    a.denominator = 1;
+    return a;
+}
+
+static Rational rsqrt(Rational a) {
+    Rational root;
+    if (!a.denominator || a.numerator < 0) return RNAN();
+    if (exact_root(a, 2, &root)) return root;
+    return approximate(sqrt(to_double(a)));
+}
+
+/* Exact for powers of ten. */
+static Rational rlog10(Rational a) {
+    unsigned long long v = a.numerator == 1 ? (unsigned long long)a.denominator : a.denominator == 1 ? uabs(a.numerator) : 0;
+    long long k = 0;
+    if (a.numerator > 0 && v) {
+        for (; v % 10 == 0; v /= 10) ++k;
+        if (v == 1) return Fraction(a.numerator == 1 ? -k : k, 1);
+    }
+    return approximate(log10(to_double(a)));
+}
+
+static Rational ratan2(Rational a, Rational b) {return approximate(atan2(to_double(a), to_double(b)));}
+
+#define TE_APPROXIMATE(name, f) static Rational name(Rational a) {return approximate(f(to_double(a)));}
+TE_APPROXIMATE(racos, acos)
+TE_APPROXIMATE(rasin, asin)
+TE_APPROXIMATE(ratan, atan)
+TE_APPROXIMATE(rcos, cos)
+TE_APPROXIMATE(rcosh, cosh)
+TE_APPROXIMATE(rexp, exp)
+TE_APPROXIMATE(rln, log)
+TE_APPROXIMATE(rsin, sin)
+TE_APPROXIMATE(rsinh, sinh)
+TE_APPROXIMATE(rtan, tan)
+TE_APPROXIMATE(rtanh, tanh)
+#undef TE_APPROXIMATE
+
+/* Non-negative integers only. */
+static Rational fac(Rational a) {
+    long long result = 1, i;
+    if (a.denominator != 1 || a.numerator < 0) return RNAN();
+    for (i = 2; i <= a.numerator; ++i) {
+        if (checked_mul(result, i, &result)) return ROVERFLOW();
+    }
+    return Fraction(result, 1);
 }
+
 static Rational ncr(Rational n, Rational r) {
-    if (n.numerator < 0.0 || r.numerator < 0.0 || n.numerator < r.denominator) return RNAN();
-    if (n.numerator > UINT_MAX || r.numerator > UINT_MAX) return RINFINITY();
-    unsigned long int un = (unsigned int)(n.numerator), ur = (unsigned int)(r.numerator), i;
-    unsigned long int result = 1;
+    unsigned long long un, ur, i, result = 1, g;
+    if (n.denominator != 1 || r.denominator != 1 || r.numerator < 0 || n.numerator < r.numerator) return RNAN();
+    un = (unsigned long long)n.numerator;
+    ur = (unsigned long long)r.numerator;
     if (ur > un / 2) ur = un - ur;
-    for (i = 1; i <= ur; i++) {
-        if (result > ULONG_MAX / (un - ur + i))
-            return RINFINITY();
-        result *= un - ur + i;
-        result /= i;
+    for (i = 1; i <= ur; ++i) {
+        /* result*(un-ur+i) is divisible by i; divide out their gcd first. */
+        unsigned long long f = un - ur + i, q = i;
+        g = ugcd(result, q); result /= g; q /= g;
+        f /= q;
+        if (result > LLONG_MAX / f) return ROVERFLOW();
+        result *= f;
     }
-    return Fraction(result,1);
+    return Fraction((long long)result, 1);
 }
-static Rational npr(Rational n, Rational r) {return mul(ncr(n, r) , fac(r));}
+
+static Rational npr(Rational n, Rational r) {return mul(ncr(n, r), fac(r));}
 
 static const te_variable functions[] = {
-    /* must be in alphabetical order */
-	//{"E",E,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
+    /* Kept alphabetical for reading; lookups hash, so order does not matter. */
+	{"E",E,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
 	{"G",G,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
 	{"M",M,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
 	{"Mhz",Mhz,       TE_FUNCTION0 | TE_FLAG_PURE, 0},	
 	{"P",P,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
 	{"T",T,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
-	//{"Y",Y,           TE_FUNCTION0 | TE_FlAG_PURE, 0},
-	//{"Z",Z,           TE_FUNCTION0 | TE_FlAG_PURE, 0},
-    {"abs", fabs,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"acos", acos,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"asin", asin,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"atan", atan,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"atan2", atan2,  TE_FUNCTION2 | TE_FLAG_PURE, 0},
+	{"Y",Y,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
+	{"Z",Z,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
+	{"a",a,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
+    {"abs", rabs,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"acos", racos,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"asin", rasin,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"atan", ratan,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"atan2", ratan2, TE_FUNCTION2 | TE_FLAG_PURE, 0},
 	{"c",c, 		  TE_FUNCTION0 | TE_FLAG_PURE, 0},
-    //{"ceil", ceil,    TE_FUNCTION0 | TE_FLAG_PURE, 0},
-    {"cos", cos,      TE_FUNCTION0 | TE_FLAG_PURE, 0},
-    {"cosh", cosh,    TE_FUNCTION0 | TE_FLAG_PURE, 0},
+    {"ceil", rceil,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"cos", rcos,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"cosh", rcosh,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
 	{"d",d,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
 	{"da",da,         TE_FUNCTION0 | TE_FLAG_PURE, 0},
-	// {"exp", exp,      TE_FUNCTION0 | TE_FLAG_PURE, 0},
-	//{"f",f,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
-    {"fac", fac,      TE_FUNCTION0 | TE_FLAG_PURE, 0},
-   // {"floor", floor,  TE_FUNCTION0 | TE_FLAG_PURE, 0},
+    {"exp", rexp,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
+	{"f",f,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
+    {"fac", fac,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"floor", rfloor, TE_FUNCTION1 | TE_FLAG_PURE, 0},
 	{"h",h,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
     {"k",k,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
-	{"ln",log,        TE_FUNCTION0 | TE_FLAG_PURE, 0},
+    {"ln", rln,       TE_FUNCTION1 | TE_FLAG_PURE, 0},
 #ifdef TE_NAT_LOG
-    {"log", log,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"log", rln,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
 #else
-    {"log", log10,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"log", rlog10,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
 #endif
-    {"log10", log10,  TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"log10", rlog10, TE_FUNCTION1 | TE_FLAG_PURE, 0},
 	{"m",m,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
 	{"n",n,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
     {"ncr", ncr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
     {"npr", npr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
 	{"p",p,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
-    {"pow", pow,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
-    {"sin", sin,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"sinh", sinh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"sqrt", sqrt,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
-	{"tan", tan,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
-    {"tanh", tanh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"pow", rpow,     TE_FUNCTION2 | TE_FLAG_PURE, 0},
+    {"sin", rsin,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"sinh", rsinh,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"sqrt", rsqrt,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"tan", rtan,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"tanh", rtanh,   TE_FUNCTION1 | TE_FLAG_PURE, 0},
 	{"u",u,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
-	//{"y",y,           TE_FUNCTION1 | TE_FLAG_PURE, 0},
-	//{"z",z,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
+	{"y",y,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
+	{"z",z,           TE_FUNCTION0 | TE_FLAG_PURE, 0},
 
     {0, 0, 0, 0}
 };
 
-static const te_variable *find_builtin(const char *name, int len) {
-    int imin = 0;
-    int imax = sizeof(functions) / sizeof(te_variable) - 2;
-
-    /*Binary search.*/
-    while (imax >= imin) {
-        const int i = (imin + ((imax-imin)/2));
-        int c = strncmp(name, functions[i].name, len);
-        if (!c) c = '\0' - functions[i].name[len];
-        if (c == 0) {
-            return functions + i;
-        } else if (c > 0) {
-            imin = i + 1;
-        } else {
-            imax = i - 1;
-        }
-    }
-
-    return 0;
-}
-
 static const te_variable *find_lookup(const state *s, const char *name, int len) {
     int iters;
     const te_variable *var;
@@ -370,72 +669,268 @@ static const te_variable *find_lookup(const state *s, const char *name, int len)
     return 0;
 }
 
+/* Threads, for te_compile_many, and one-time initialization. */
+#if !defined(TE_NO_THREADS) && defined(_WIN32)
+#include <windows.h>
+typedef HANDLE te_thread;
+typedef CRITICAL_SECTION te_lock;
+#define lock_init(l) InitializeCriticalSection(l)
+#define lock_free(l) DeleteCriticalSection(l)
+#define lock_take(l) EnterCriticalSection(l)
+#define lock_give(l) LeaveCriticalSection(l)
+typedef INIT_ONCE te_once;
+#define TE_ONCE_INIT INIT_ONCE_STATIC_INIT
+static BOOL CALLBACK once_call(PINIT_ONCE once, PVOID f, PVOID *unused) {
+    (void)once;
+    (void)unused;
+    ((void (*)(void))f)();
+    return TRUE;
+}
+#define run_once(o, f) InitOnceExecuteOnce(o, once_call, (PVOID)(f), 0)
+#define TE_THREADS
+#elif !defined(TE_NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t te_thread;
+typedef pthread_mutex_t te_lock;
+#define lock_init(l) pthread_mutex_init(l, 0)
+#define lock_free(l) pthread_mutex_destroy(l)
+#define lock_take(l) pthread_mutex_lock(l)
+#define lock_give(l) pthread_mutex_unlock(l)
+typedef pthread_once_t te_once;
+#define TE_ONCE_INIT PTHREAD_ONCE_INIT
+#define run_once(o, f) pthread_once(o, f)
+#define TE_THREADS
+#else
+typedef int te_once;
+#define TE_ONCE_INIT 0
+#define run_once(o, f) do { if (!*(o)) { *(o) = 1; (f)(); } } while (0)
+#endif
+
+/* Hashed identifiers. Builtins go through a perfect hash: a seed is searched
+ * for that gives every builtin its own slot, so a lookup is one probe and one
+ * compare. User variables go in an open-addressing map. Both are read-only
+ * once built, so one table can serve any number of compiles and threads. */
+struct te_symbols {
+    unsigned seed;
+    unsigned builtin_mask;
+    const te_variable **builtins;
+    unsigned mask;
+    const te_variable **variables;
+};
+
+/* te_compile hashes its variables itself from this many on. */
+#define TE_HASH_MIN 16
+
+/* FNV-1a. */
+static unsigned hash_name(const char *name, int len, unsigned seed) {
+    unsigned h = 2166136261u ^ seed;
+    int i;
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int same_name(const te_variable *var, const char *name, int len) {
+    return strncmp(name, var->name, len) == 0 && var->name[len] == '\0';
+}
+
+static unsigned table_mask(int count) {
+    unsigned size = 8;
+    while (size < 2u * (unsigned)count) size <<= 1;
+    return size - 1;
+}
+
+/* Fills slots with the builtins and returns 1 if no two collide under seed.
+ * A repeated name keeps its first entry, since it would collide under all. */
+static int place_builtins(const te_variable **slots, unsigned mask, unsigned seed) {
+    const int count = sizeof(functions) / sizeof(te_variable) - 1;
+    int i;
+    memset(slots, 0, sizeof(*slots) * (mask + 1));
+    for (i = 0; i < count; ++i) {
+        const int len = strlen(functions[i].name);
+        const te_variable **slot = slots + (hash_name(functions[i].name, len, seed) & mask);
+        if (*slot && same_name(*slot, functions[i].name, len)) continue;
+        if (*slot) return 0;
+        *slot = functions + i;
+    }
+    return 1;
+}
+
+/* Without builtins the table only indexes the variables and builtins go
+ * through find_builtin's shared table; te_compile uses that for its
+ * throwaway tables. */
+static te_symbols *symbols_create(const te_variable *variables, int var_count, int builtins) {
+    const int builtin_count = sizeof(functions) / sizeof(te_variable) - 1;
+    unsigned builtin_mask = builtins ? table_mask(builtin_count) : 0, mask = table_mask(var_count), seed = 0;
+    te_symbols *sym = 0;
+    int i;
+
+    /* Doubling the table makes a collision-free seed quick to find. */
+    for (;;) {
+        free(sym);
+        sym = malloc(sizeof(te_symbols) + sizeof(te_variable*) * (builtin_mask + 1 + mask + 1));
+        if (!sym) return 0;
+        sym->builtins = (const te_variable**)(sym + 1);
+        if (!builtins) break;
+        for (seed = 0; seed < 256; ++seed) {
+            if (place_builtins(sym->builtins, builtin_mask, seed)) break;
+        }
+        if (seed < 256) break;
+        builtin_mask = builtin_mask * 2 + 1;
+    }
+    sym->seed = seed;
+    sym->builtin_mask = builtin_mask;
+    sym->mask = mask;
+    sym->variables = sym->builtins + builtin_mask + 1;
+    memset(sym->variables, 0, sizeof(te_variable*) * (mask + 1));
+    if (!builtins) sym->builtins = 0;
+
+    /* Linear probing. The first of several equal names wins, as with te_compile. */
+    for (i = 0; i < var_count; ++i) {
+        const int len = strlen(variables[i].name);
+        unsigned h = hash_name(variables[i].name, len, 0) & mask;
+        while (sym->variables[h] && !same_name(sym->variables[h], variables[i].name, len)) h = (h + 1) & mask;
+        if (!sym->variables[h]) sym->variables[h] = variables + i;
+    }
+    return sym;
+}
+
+te_symbols *te_symbols_create(const te_variable *variables, int var_count) {
+    return symbols_create(variables, var_count, 1);
+}
+
+void te_symbols_free(te_symbols *sym) {
+    free(sym);
+}
+
+/* Builtins for the paths without a te_symbols of their own, hashed once per
+ * process. The table is never freed. */
+static te_symbols *builtin_table;
+static te_once builtin_once = TE_ONCE_INIT;
+
+static void builtin_table_create(void) {
+    builtin_table = symbols_create(0, 0, 1);
+}
+
+static const te_variable *find_builtin(const char *name, int len) {
+    const te_variable *var;
+    run_once(&builtin_once, builtin_table_create);
+    if (!builtin_table) {
+        /* Out of memory: a plain scan still finds them. */
+        for (var = functions; var->name; ++var) {
+            if (same_name(var, name, len)) return var;
+        }
+        return 0;
+    }
+    var = builtin_table->builtins[hash_name(name, len, builtin_table->seed) & builtin_table->builtin_mask];
+    return var && same_name(var, name, len) ? var : 0;
+}
+
+static const te_variable *find_symbol(const te_symbols *sym, const char *name, int len) {
+    const te_variable *var;
+    unsigned h = hash_name(name, len, 0) & sym->mask;
+
+    for (; (var = sym->variables[h]) != 0; h = (h + 1) & sym->mask) {
+        if (same_name(var, name, len)) return var;
+    }
+    if (!sym->builtins) return find_builtin(name, len);
+    var = sym->builtins[hash_name(name, len, sym->seed) & sym->builtin_mask];
+    return var && same_name(var, name, len) ? var : 0;
+}
+
 static Rational comma(Rational a, Rational b){(void) a; return b;}
 
-Rational convert_str(const char *st, char **end){
-  	char *numer = (char *)malloc(sizeof(char)*strlen(st));
-	char *dummy_pt; // Return value of the integer conversion I do not need.
-	double dummy_num; // Dummy float number that it would have converted that I do not need.
-	char dot;
-	int point_found, point_loc, remaining_str;
-  	int i;
-	int j;
-  	long int denom;
-  	dot='.';
-	j=0;
-	point_found = 0;
-	remaining_str = 0;
-  	for(i = 0; i < strlen(st); i++)
-  	{
-		if ((st[i] >= '0' && st[i] <= '9') || st[i] == dot){
-			if(st[i] == dot)  
-			{
-				point_found = 1;
-				point_loc=i;
-			}
-			else{
-				numer[j]=st[i];
-				j = j+1;
-			}
-		}
-		else{
-			remaining_str = 1;
-			break;
-		}
-	}
-	*end = st+i;
-	/*
-	if (remaining_str==1){
-		*end = st+i;
-	}
-	else{
-		*end = st+i+1;
-	}
-	*/
-	// printf("DEBUG: Remaining string %s\n",**end);
-	if(point_found == 1){
-		//printf("DEBUG: i: %d, point_loc=%d, power=%d\n",i,point_loc,i-point_loc-1);
-		denom=pow(10,i-point_loc-1);
-	}
-	else{
-		denom=1;
-	}
-	//printff("DEBUG: begining st pointer :%d\n",st);
-	//printff("DEBUG: What I set :%d\n",*end);
-	// dummy_num = strtod(st,end); // 1*M, 1.4*M, 1e4
-	// //printff("DEBUG: begining st pointer :%d\n",st);
-	// printf("DEBUG: strtod sets to :%d\n",*end);
-	// printf("DEBUG: Dummy number found is : %f\n",dummy_num);
-  	Rational result;
-	result = Fraction((long long)strtol(numer, &dummy_pt,10), (long long)denom);
-  	// printf("DEBUG: Convert Str: (%lld, %lld)\n",result.numerator,result.denominator);
-	free(numer);
-	return result;
-	
+/* Exponents are clamped here; anything this large overflows either way. */
+#define TE_MAX_EXPONENT 100000
+
+/* Scans a decimal literal such as "12", "1.25", ".5", "3e-4" or "2E6" in one
+ * pass. The digits are returned as an integer with the power of ten that
+ * scales them, trailing zeros folded into the power. Returns 0 if the digits
+ * do not fit in 64 bits. */
+static int scan_number(const char *p, const char **end, unsigned long long *digits, int *exponent) {
+    unsigned long long num = 0;
+    int zeros = 0, scale = 0, d;
+    const char *q;
+
+    for (;; ++p) {
+        if (*p == '.') {
+            if (scale) break;
+            scale = -1;
+            continue;
+        }
+        if (*p < '0' || *p > '9') break;
+        d = *p - '0';
+        if (scale) --scale;
+        if (d == 0) {
+            /* Zeros are only multiplied in once a nonzero digit follows. */
+            if (num) ++zeros;
+            continue;
+        }
+        for (; zeros >= 0; --zeros) {
+            if (num > ULLONG_MAX / 10) return 0;
+            num *= 10;
+        }
+        zeros = 0;
+        if (num > ULLONG_MAX - d) return 0;
+        num += d;
+    }
+    /* scale counted the dot itself. */
+    if (scale) ++scale;
+
+    /* Only consume the exponent marker if digits follow, so "2e" stays "2" "e". */
+    q = p;
+    if (*q == 'e' || *q == 'E') {
+        int sign = 1, e = 0;
+        ++q;
+        if (*q == '+' || *q == '-') sign = *q++ == '-' ? -1 : 1;
+        if (*q >= '0' && *q <= '9') {
+            for (; *q >= '0' && *q <= '9'; ++q) {
+                if (e < TE_MAX_EXPONENT) e = e * 10 + (*q - '0');
+            }
+            scale += sign * (e < TE_MAX_EXPONENT ? e : TE_MAX_EXPONENT);
+            p = q;
+        }
+    }
+
+    *end = p;
+    *digits = num;
+    *exponent = num ? scale + zeros : 0;
+    return 1;
+}
+
+/* digits * 10^exponent, exactly. The denominator only has factors 2 and 5,
+ * so cancelling those against the numerator leaves lowest terms. */
+static Rational scale10(unsigned long long digits, int exponent) {
+    Rational r;
+    long long den = 1;
+    int twos, fives;
+
+    twos = fives = exponent < 0 && digits ? -exponent : 0;
+    for (; twos && !(digits & 1); --twos) digits >>= 1;
+    for (; fives && digits % 5 == 0; --fives) digits /= 5;
+    if (digits > LLONG_MAX) return ROVERFLOW();
+
+    r.numerator = (long long)digits;
+    r.denominator = 1;
+    for (; exponent > 0; --exponent) {
+        if (checked_mul(r.numerator, 10, &r.numerator)) return ROVERFLOW();
+    }
+    for (; twos; --twos) {
+        if (checked_mul(den, 2, &den)) return ROVERFLOW();
+    }
+    for (; fives; --fives) {
+        if (checked_mul(den, 5, &den)) return ROVERFLOW();
+    }
+    r.denominator = den;
+    return r;
 }
 
 void next_token(state *s) {
     s->type = TOK_NULL;
+    s->interned = 0;
 
     do {
 
@@ -446,18 +941,37 @@ void next_token(state *s) {
 
         /* Try reading a number. */
         if ((s->next[0] >= '0' && s->next[0] <= '9') || s->next[0] == '.') {
-			// printf("DEBUG: Number = %s\n",s->next);
-            s->value = convert_str(s->next, (char**)&s->next);
+            unsigned long long digits;
+            if (!scan_number(s->next, &s->next, &digits, &s->exponent)) {
+                s->type = TOK_ERROR;
+                return;
+            }
+            s->value = scale10(digits, s->exponent);
+            if (s->value.denominator) {
+                s->exponent = 0;
+            } else if (digits > LLONG_MAX) {
+                s->type = TOK_ERROR;
+                return;
+            } else {
+                /* Left to base() as digits*10^exponent, which te_eval_big can still represent. */
+                s->value.numerator = digits;
+                s->value.denominator = 1;
+            }
             s->type = TOK_NUMBER;
         } else {
             /* Look for a variable or builtin function call. */
-            if (isalpha(s->next[0]) &&!( s->next[0]=='e' || s->next[0]=='E')) {
+            if (isalpha(s->next[0])) {
                 const char *start;
                 start = s->next;
                 while (isalpha(s->next[0]) || isdigit(s->next[0]) || (s->next[0] == '_')) s->next++;
                 
-                const te_variable *var = find_lookup(s, start, s->next - start);
-                if (!var) var = find_builtin(start, s->next - start);
+                const te_variable *var;
+                if (s->symbols) {
+                    var = find_symbol(s->symbols, start, s->next - start);
+                } else {
+                    var = find_lookup(s, start, s->next - start);
+                    if (!var) var = find_builtin(start, s->next - start);
+                }
 
                 if (!var) {
                     s->type = TOK_ERROR;
@@ -477,6 +991,10 @@ void next_token(state *s) {
                         case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:     /* Falls through. */
                             s->type = var->type;
                             s->function = var->address;
+                            if (s->constants && var >= functions && var < functions + sizeof(functions) / sizeof(te_variable)
+                                    && s->constants[var - functions].denominator) {
+                                s->interned = &s->constants[var - functions];
+                            }
                             break;
                     }
                 }
@@ -488,10 +1006,8 @@ void next_token(state *s) {
                     case '-': s->type = TOK_INFIX; s->function = sub; break;
                     case '*': s->type = TOK_INFIX; s->function = mul; break;
                     case '/': s->type = TOK_INFIX; s->function = divide; break;
-                    case 'e': s->type = TOK_INFIX; s->function = tenpow; break;
-                    case 'E': s->type = TOK_INFIX; s->function = tenpow; break;
-                    case '^': s->type = TOK_INFIX; s->function = pow; break;
-                    case '%': s->type = TOK_INFIX; s->function = fmod; break;
+                    case '^': s->type = TOK_INFIX; s->function = rpow; break;
+                    case '%': s->type = TOK_INFIX; s->function = rmod; break;
                     case '(': s->type = TOK_OPEN; break;
                     case ')': s->type = TOK_CLOSE; break;
                     case ',': s->type = TOK_SEP; break;
@@ -515,23 +1031,34 @@ static te_expr *base(state *s) {
 
     switch (TYPE_MASK(s->type)) {
         case TOK_NUMBER:
-            ret = new_expr(TE_CONSTANT, 0);
-			//printff("Return Value set = (%lld,%lld)\n",s->value.numerator, s->value.denominator);
+            ret = new_expr(s, TE_CONSTANT, 0);
             ret->value = s->value;
+            if (s->exponent) {
+                te_expr *scale = new_expr(s, TE_CONSTANT, 0);
+                scale->value.numerator = s->exponent;
+                scale->value.denominator = 1;
+                ret = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, ret, scale);
+                ret->function = tenpow;
+            }
             next_token(s);
             break;
 
         case TOK_VARIABLE:
-            ret = new_expr(TE_VARIABLE, 0);
+            ret = new_expr(s, TE_VARIABLE, 0);
             ret->bound = s->bound;
             next_token(s);
             break;
 
         case TE_FUNCTION0:
         case TE_CLOSURE0:
-            ret = new_expr(s->type, 0);
-            ret->function = s->function;
-            if (IS_CLOSURE(s->type)) ret->parameters[0] = s->context;
+            if (s->interned) {
+                ret = new_expr(s, TE_CONSTANT, 0);
+                ret->value = *s->interned;
+            } else {
+                ret = new_expr(s, s->type, 0);
+                ret->function = s->function;
+                if (IS_CLOSURE(s->type)) ret->parameters[0] = s->context;
+            }
             next_token(s);
             if (s->type == TOK_OPEN) {
                 next_token(s);
@@ -545,7 +1072,7 @@ static te_expr *base(state *s) {
 
         case TE_FUNCTION1:
         case TE_CLOSURE1:
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s, s->type, 0);
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
             next_token(s);
@@ -558,7 +1085,7 @@ static te_expr *base(state *s) {
         case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
             arity = ARITY(s->type);
 
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s, s->type, 0);
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[arity] = s->context;
             next_token(s);
@@ -594,7 +1121,7 @@ static te_expr *base(state *s) {
             break;
 
         default:
-            ret = new_expr(0, 0);
+            ret = new_expr(s, 0, 0);
             s->type = TOK_ERROR;
             ret->value = RNAN();
             break;
@@ -617,7 +1144,7 @@ static te_expr *power(state *s) {
     if (sign == 1) {
         ret = base(s);
     } else {
-        ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE, base(s));
+        ret = NEW_EXPR(s, TE_FUNCTION1 | TE_FLAG_PURE, base(s));
         ret->function = negate;
     }
 
@@ -625,6 +1152,11 @@ static te_expr *power(state *s) {
 }
 
 #ifdef TE_POW_FROM_RIGHT
+/* Releases a node that was only used while parsing. */
+static void drop_expr(state *s, te_expr *n) {
+    if (!s->arena) free(n);
+}
+
 static te_expr *factor(state *s) {
     /* <factor>    =    <power> {"^" <power>} */
     te_expr *ret = power(s);
@@ -633,32 +1165,32 @@ static te_expr *factor(state *s) {
 
     if (ret->type == (TE_FUNCTION1 | TE_FLAG_PURE) && ret->function == negate) {
         te_expr *se = ret->parameters[0];
-        free(ret);
+        drop_expr(s, ret);
         ret = se;
         neg = 1;
     }
 
     te_expr *insertion = 0;
 
-    while (s->type == TOK_INFIX && (s->function == pow)) {
+    while (s->type == TOK_INFIX && (s->function == rpow)) {
         te_fun2 t = s->function;
         next_token(s);
 
         if (insertion) {
             /* Make exponentiation go right-to-left. */
-            te_expr *insert = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, insertion->parameters[1], power(s));
+            te_expr *insert = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, insertion->parameters[1], power(s));
             insert->function = t;
             insertion->parameters[1] = insert;
             insertion = insert;
         } else {
-            ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, power(s));
+            ret = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, ret, power(s));
             ret->function = t;
             insertion = ret;
         }
     }
 
     if (neg) {
-        ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE, ret);
+        ret = NEW_EXPR(s, TE_FUNCTION1 | TE_FLAG_PURE, ret);
         ret->function = negate;
     }
 
@@ -669,10 +1201,10 @@ static te_expr *factor(state *s) {
     /* <factor>    =    <power> {"^" <power>} */
     te_expr *ret = power(s);
 
-    while (s->type == TOK_INFIX && (s->function == pow)) {
+    while (s->type == TOK_INFIX && (s->function == rpow)) {
         te_fun2 t = s->function;
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, power(s));
+        ret = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, ret, power(s));
         ret->function = t;
     }
 
@@ -686,10 +1218,10 @@ static te_expr *term(state *s) {
     /* <term>      =    <factor> {("*" | "/" | "%") <factor>} */
     te_expr *ret = factor(s);
 
-    while (s->type == TOK_INFIX && (s->function == mul || s->function == divide || s->function == fmod || s->function == tenpow)) {
+    while (s->type == TOK_INFIX && (s->function == mul || s->function == divide || s->function == rmod)) {
         te_fun2 t = s->function;
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, factor(s));
+        ret = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, ret, factor(s));
         ret->function = t;
     }
 
@@ -704,7 +1236,7 @@ static te_expr *expr(state *s) {
     while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
         te_fun2 t = s->function;
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, term(s));
+        ret = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, ret, term(s));
         ret->function = t;
     }
 
@@ -718,7 +1250,7 @@ static te_expr *list(state *s) {
 
     while (s->type == TOK_SEP) {
         next_token(s);
-        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, expr(s));
+        ret = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, ret, expr(s));
         ret->function = comma;
     }
 
@@ -773,67 +1305,3312 @@ Rational te_eval(const te_expr *n) {
 #undef TE_FUN
 #undef M
 
-static void optimize(te_expr *n) {
-    /* Evaluates as much as possible. */
-    if (n->type == TE_CONSTANT) return;
-    if (n->type == TE_VARIABLE) return;
+/* Algebraic rewrites. Chains of add/sub/negate and of mul/divide are
+ * flattened so every constant in them merges into one wherever it sits, and
+ * identities drop what is left: 2*x*3 -> x*6, x+0 -> x, -(-x) -> x, k*m -> 1.
+ * A rebuilt chain keeps the order of its other terms; only constants move. */
 
-    /* Only optimize out functions flagged as pure. */
-    if (IS_PURE(n->type)) {
-        const int arity = ARITY(n->type);
-        int known = 1;
-        int i;
-        for (i = 0; i < arity; ++i) {
-            optimize(n->parameters[i]);
-            if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
-                known = 0;
-            }
-        }
-        if (known) {
-            const Rational value = te_eval(n);
-            te_free_parameters(n);
-            n->type = TE_CONSTANT;
-            n->value = value;
-        }
+typedef struct te_term {
+    te_expr **slot;     /* Where the term hangs, so it can be optimized in place. */
+    int invert;         /* Subtracted in an add chain, divided by in a mul chain. */
+    int dropped;        /* Merged into the chain's constant, or no longer needed. */
+} te_term;
+
+typedef struct te_chain {
+    te_term *terms;
+    te_expr **links;    /* The chain's own nodes, which a rebuild replaces. */
+    int terms_len, terms_cap;
+    int links_len, links_cap;
+    int negates;        /* negate nodes among the links. */
+    int failed;         /* Out of memory: leave the chain as it is. */
+} te_chain;
+
+static te_expr *optimize(state *s, te_expr *n);
+
+static int grow(void **items, int *cap, int len, size_t size) {
+    void *p;
+    if (len < *cap) return 1;
+    p = realloc(*items, size * (*cap ? *cap * 2 : 16));
+    if (!p) return 0;
+    *items = p;
+    *cap = *cap ? *cap * 2 : 16;
+    return 1;
+}
+
+static void chain_term(te_chain *c, te_expr **slot, int invert) {
+    if (!grow((void**)&c->terms, &c->terms_cap, c->terms_len, sizeof(te_term))) {
+        c->failed = 1;
+        return;
     }
+    c->terms[c->terms_len].slot = slot;
+    c->terms[c->terms_len].invert = invert;
+    c->terms[c->terms_len].dropped = 0;
+    ++c->terms_len;
 }
 
+static void chain_link(te_chain *c, te_expr *link) {
+    if (!grow((void**)&c->links, &c->links_cap, c->links_len, sizeof(te_expr*))) {
+        c->failed = 1;
+        return;
+    }
+    c->links[c->links_len++] = link;
+}
 
-te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
-    state s;
-    s.start = s.next = expression;
-    s.lookup = variables;
-    s.lookup_len = var_count;
+static int is_pure_call(const te_expr *n, int type, const void *function) {
+    return n->type == (type | TE_FLAG_PURE) && n->function == function;
+}
 
-    next_token(&s);
-    te_expr *root = list(&s);
+static int is_add_link(const te_expr *n) {
+    return is_pure_call(n, TE_FUNCTION2, add) || is_pure_call(n, TE_FUNCTION2, sub) || is_pure_call(n, TE_FUNCTION1, negate);
+}
 
-    if (s.type != TOK_END) {
-        te_free(root);
-        if (error) {
-            *error = (s.next - s.start);        
-            if (*error == 0) *error = 1;
+static int is_mul_link(const te_expr *n) {
+    return is_pure_call(n, TE_FUNCTION2, mul) || is_pure_call(n, TE_FUNCTION2, divide);
+}
+
+static int is_nonzero_constant(const te_expr *n) {
+    return n->type == TE_CONSTANT && n->value.numerator && n->value.denominator;
+}
+
+/* Collects the terms of an add chain, optimizing each one. */
+static void gather_add(state *s, te_chain *c, te_expr **slot, int invert) {
+    te_expr *n = *slot;
+    if (is_add_link(n)) {
+        chain_link(c, n);
+        if (n->function == negate) {
+            ++c->negates;
+            gather_add(s, c, (te_expr**)&n->parameters[0], !invert);
+        } else {
+            gather_add(s, c, (te_expr**)&n->parameters[0], invert);
+            gather_add(s, c, (te_expr**)&n->parameters[1], invert ^ (n->function == sub));
         }
-        return 0;
     } else {
-        optimize(root);
-        if (error) *error = 0;
-        return root;
+        *slot = optimize(s, n);
+        chain_term(c, slot, invert);
     }
 }
 
-Rational te_interp(const char *expression, int *error) {
-    te_expr *n = te_compile(expression, 0, 0, error);
-    Rational ret;
-    if (n) {
-        ret = te_eval(n);
-        te_free(n);
+/* Collects the factors of a mul chain; a negate inside it becomes a sign.
+ * A division inside a divisor is only flattened when it divides by a nonzero
+ * constant: x/(a/b) is undefined at b = 0, but x*b/a would not be. */
+static void gather_mul(state *s, te_chain *c, te_expr **slot, int invert) {
+    te_expr *n = *slot;
+    if (is_mul_link(n) && invert && n->function == divide) {
+        n->parameters[1] = optimize(s, n->parameters[1]);
+    }
+    if (is_mul_link(n) && !(invert && n->function == divide && !is_nonzero_constant(n->parameters[1]))) {
+        chain_link(c, n);
+        gather_mul(s, c, (te_expr**)&n->parameters[0], invert);
+        gather_mul(s, c, (te_expr**)&n->parameters[1], invert ^ (n->function == divide));
+    } else if (is_pure_call(n, TE_FUNCTION1, negate)) {
+        chain_link(c, n);
+        ++c->negates;
+        gather_mul(s, c, (te_expr**)&n->parameters[0], invert);
     } else {
-        ret = RNAN();
+        *slot = optimize(s, n);
+        chain_term(c, slot, invert);
+    }
+}
+
+/* Folds the chain's constants into acc, marking the ones merged, and returns how many. */
+static int merge_constants(te_chain *c, Rational *acc, te_fun2 f, te_fun2 inverse) {
+    int merged = 0, i;
+    for (i = 0; i < c->terms_len; ++i) {
+        const te_expr *t = *c->terms[i].slot;
+        Rational r;
+        if (t->type != TE_CONSTANT) continue;
+        r = (c->terms[i].invert ? inverse : f)(*acc, t->value);
+        /* A merge that overflows keeps its constant. */
+        if (!r.denominator) continue;
+        *acc = r;
+        c->terms[i].dropped = 1;
+        ++merged;
+    }
+    return merged;
+}
+
+/* After a rebuild, frees the dropped terms and the chain's old nodes. */
+static void release_chain(state *s, te_chain *c, int rebuilt) {
+    int i;
+    if (rebuilt && !s->arena) {
+        for (i = 0; i < c->terms_len; ++i) {
+            if (c->terms[i].dropped) te_free(*c->terms[i].slot);
+        }
+        for (i = 0; i < c->links_len; ++i) free(c->links[i]);
     }
+    free(c->terms);
+    free(c->links);
+}
+
+static te_expr *constant(state *s, Rational value) {
+    te_expr *ret = new_expr(s, TE_CONSTANT, 0);
+    ret->value = value;
+    return ret;
+}
+
+static te_expr *call1(state *s, const void *f, te_expr *a) {
+    te_expr *ret = NEW_EXPR(s, TE_FUNCTION1 | TE_FLAG_PURE, a);
+    ret->function = f;
     return ret;
 }
 
+static te_expr *call2(state *s, const void *f, te_expr *a, te_expr *b) {
+    te_expr *ret = NEW_EXPR(s, TE_FUNCTION2 | TE_FLAG_PURE, a, b);
+    ret->function = f;
+    return ret;
+}
+
+static int is_value(Rational a, long long value) {
+    return a.numerator == value && a.denominator == 1;
+}
+
+/* Whether n has a value whenever its variables do: no division, no calls. */
+static int total(const te_expr *n) {
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return n->value.denominator != 0;
+        case TE_VARIABLE: return 1;
+    }
+    if (is_pure_call(n, TE_FUNCTION1, negate)) return total(n->parameters[0]);
+    if (is_pure_call(n, TE_FUNCTION2, add) || is_pure_call(n, TE_FUNCTION2, sub) || is_pure_call(n, TE_FUNCTION2, mul)) {
+        return total(n->parameters[0]) && total(n->parameters[1]);
+    }
+    return 0;
+}
+
+static te_expr *simplify_add(state *s, te_expr *n) {
+    Rational acc = {0, 1};
+    te_expr *ret = 0;
+    te_chain c;
+    int merged, pass, i;
+
+    memset(&c, 0, sizeof(c));
+    gather_add(s, &c, &n, 0);
+    merged = merge_constants(&c, &acc, add, sub);
+
+    /* A lone negate at the root is already as small as it gets. */
+    if (!c.failed && (merged == c.terms_len || merged >= 2 || (merged == 1 && !acc.numerator)
+            || c.negates > is_pure_call(n, TE_FUNCTION1, negate))) {
+        /* Added terms first, so a subtracted one never needs a negate. */
+        for (pass = 0; pass < 2; ++pass) {
+            for (i = 0; i < c.terms_len; ++i) {
+                te_expr *t = *c.terms[i].slot;
+                if (c.terms[i].dropped || c.terms[i].invert != pass) continue;
+                if (!ret) ret = pass ? call1(s, negate, t) : t;
+                else ret = call2(s, pass ? sub : add, ret, t);
+            }
+        }
+        if (!ret) ret = constant(s, acc);
+        else if (acc.numerator < 0 && acc.numerator != LLONG_MIN) ret = call2(s, sub, ret, constant(s, negate(acc)));
+        else if (acc.numerator) ret = call2(s, add, ret, constant(s, acc));
+    }
+
+    release_chain(s, &c, ret != 0);
+    return ret ? ret : n;
+}
+
+static te_expr *simplify_mul(state *s, te_expr *n) {
+    Rational acc = {1, 1};
+    te_expr *ret = 0;
+    te_chain c;
+    int merged, negative = 0, zero, i;
+
+    memset(&c, 0, sizeof(c));
+    gather_mul(s, &c, &n, 0);
+    merged = merge_constants(&c, &acc, mul, divide);
+    if (c.negates & 1) {
+        const Rational r = negate(acc);
+        if (r.denominator) acc = r;
+        else negative = 1;
+    }
+
+    /* x*0 is 0 only if x cannot be undefined itself. */
+    zero = merged && !acc.numerator;
+    for (i = 0; zero && i < c.terms_len; ++i) {
+        zero = c.terms[i].dropped || (!c.terms[i].invert && total(*c.terms[i].slot));
+    }
+
+    if (!c.failed && (merged == c.terms_len || merged >= 2 || zero || (merged == 1 && is_value(acc, 1)) || c.negates)) {
+        if (zero) {
+            for (i = 0; i < c.terms_len; ++i) c.terms[i].dropped = 1;
+            ret = constant(s, acc);
+        } else {
+            for (i = 0; i < c.terms_len; ++i) {
+                if (c.terms[i].dropped || c.terms[i].invert) continue;
+                ret = ret ? call2(s, mul, ret, *c.terms[i].slot) : *c.terms[i].slot;
+            }
+            if (ret && is_value(acc, -1)) negative ^= 1;
+            else if (!is_value(acc, 1)) ret = ret ? call2(s, mul, ret, constant(s, acc)) : constant(s, acc);
+            for (i = 0; i < c.terms_len; ++i) {
+                if (c.terms[i].dropped || !c.terms[i].invert) continue;
+                ret = call2(s, divide, ret ? ret : constant(s, acc), *c.terms[i].slot);
+            }
+            if (!ret) ret = constant(s, acc);
+            if (negative) ret = call1(s, negate, ret);
+        }
+    }
+
+    release_chain(s, &c, ret != 0);
+    return ret ? ret : n;
+}
+
+/* x^1 -> x, and x^2 -> x*x for a variable x. */
+static te_expr *simplify_power(state *s, te_expr *n) {
+    te_expr *base = n->parameters[0], *exponent = n->parameters[1], *ret;
+    if (exponent->type != TE_CONSTANT) return n;
+    if (is_value(exponent->value, 1)) {
+        ret = base;
+    } else if (is_value(exponent->value, 2) && base->type == TE_VARIABLE) {
+        te_expr *copy = new_expr(s, TE_VARIABLE, 0);
+        copy->bound = base->bound;
+        ret = call2(s, mul, base, copy);
+    } else {
+        return n;
+    }
+    if (!s->arena) {
+        free(exponent);
+        free(n);
+    }
+    return ret;
+}
+
+/* Returns the node that replaces n. */
+static te_expr *optimize(state *s, te_expr *n) {
+    const int arity = ARITY(n->type);
+    int known = 1, i;
+
+    if (n->type == TE_CONSTANT) return n;
+    if (n->type == TE_VARIABLE) return n;
+    if (is_add_link(n)) return simplify_add(s, n);
+    if (is_mul_link(n)) return simplify_mul(s, n);
+
+    for (i = 0; i < arity; ++i) {
+        n->parameters[i] = optimize(s, n->parameters[i]);
+        if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
+            known = 0;
+        }
+    }
+
+    /* Only optimize out functions flagged as pure. */
+    if (!IS_PURE(n->type)) return n;
+    if (known) {
+        /* Evaluates as much as possible. */
+        const Rational value = te_eval(n);
+        /* Leave values that overflow for te_eval_big to compute exactly. */
+        if (value.denominator) {
+            if (!s->arena) te_free_parameters(n);
+            n->type = TE_CONSTANT;
+            n->value = value;
+            return n;
+        }
+    }
+    if (is_pure_call(n, TE_FUNCTION2, rpow)) return simplify_power(s, n);
+    return n;
+}
+
+
+te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
+    state s;
+    te_symbols *sym = var_count >= TE_HASH_MIN ? symbols_create(variables, var_count, 0) : 0;
+    s.start = s.next = expression;
+    s.lookup = variables;
+    s.lookup_len = var_count;
+    s.arena = 0;
+    s.symbols = sym;
+    s.constants = 0;
+
+    next_token(&s);
+    te_expr *root = list(&s);
+    te_symbols_free(sym);
+
+    if (s.type != TOK_END) {
+        te_free(root);
+        if (error) {
+            *error = (s.next - s.start);        
+            if (*error == 0) *error = 1;
+        }
+        return 0;
+    } else {
+        root = optimize(&s, root);
+        if (error) *error = 0;
+        return root;
+    }
+}
+
+
+static size_t tree_size(const te_expr *n, int *nodes) {
+    size_t size = node_size(n->type);
+    int i;
+    ++*nodes;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        size += tree_size(n->parameters[i], nodes);
+    }
+    return size;
+}
+
+/* Hash-consing table for packing. Identical subtrees are packed once and
+ * shared, turning the tree into a DAG. Impure calls are never shared, since
+ * the bytecode evaluates a shared node only once. */
+typedef struct te_dag {
+    te_expr **slots;
+    unsigned mask;
+    /* Programs: a variable bound to results[i] stands for formula i, packed as roots[i]. */
+    const Rational *results;
+    te_expr **roots;
+    int count;
+} te_dag;
+
+static int shareable(const te_expr *n) {
+    return TYPE_MASK(n->type) == TE_CONSTANT || TYPE_MASK(n->type) == TE_VARIABLE || IS_PURE(n->type);
+}
+
+/* Children are already packed, so comparing their addresses compares their contents. */
+static unsigned node_hash(const te_expr *n) {
+    const int arity = ARITY(n->type) + (IS_CLOSURE(n->type) ? 1 : 0);
+    unsigned long long h = (unsigned long long)n->type * 0x9E3779B97F4A7C15ull;
+    int i;
+    if (TYPE_MASK(n->type) == TE_CONSTANT) {
+        h ^= (unsigned long long)n->value.numerator * 0xC2B2AE3D27D4EB4Full;
+        h ^= (unsigned long long)n->value.denominator * 0x165667B19E3779F9ull;
+    } else {
+        h ^= (unsigned long long)(size_t)n->function * 0xC2B2AE3D27D4EB4Full;
+    }
+    for (i = 0; i < arity; ++i) {
+        h = (h ^ (unsigned long long)(size_t)n->parameters[i]) * 0x9E3779B97F4A7C15ull;
+    }
+    return (unsigned)(h ^ (h >> 32));
+}
+
+static int same_node(const te_expr *a, const te_expr *b) {
+    const int arity = ARITY(a->type) + (IS_CLOSURE(a->type) ? 1 : 0);
+    int i;
+    if (a->type != b->type) return 0;
+    if (TYPE_MASK(a->type) == TE_CONSTANT) {
+        return a->value.numerator == b->value.numerator && a->value.denominator == b->value.denominator;
+    }
+    if (a->function != b->function) return 0;
+    for (i = 0; i < arity; ++i) {
+        if (a->parameters[i] != b->parameters[i]) return 0;
+    }
+    return 1;
+}
+
+/* Copies n to at, or to *cursor after its children when at is NULL. A node
+ * placed at the cursor that duplicates an earlier one is taken back and the
+ * earlier one returned. Without a table this is a plain copy. */
+static te_expr *pack_tree(const te_expr *n, char **cursor, te_dag *dag, te_expr *at) {
+    const size_t size = node_size(n->type);
+    const te_expr *params[7];
+    te_expr *ret, **slot;
+    int i;
+
+    if (dag && dag->roots && TYPE_MASK(n->type) == TE_VARIABLE && n->bound >= dag->results && n->bound < dag->results + dag->count) {
+        return dag->roots[n->bound - dag->results];
+    }
+    for (i = 0; i < ARITY(n->type); ++i) {
+        params[i] = pack_tree(n->parameters[i], cursor, dag, 0);
+    }
+    ret = at ? at : (te_expr*)*cursor;
+    memcpy(ret, n, size);
+    for (i = 0; i < ARITY(n->type); ++i) {
+        ret->parameters[i] = (te_expr*)params[i];
+    }
+    if (!at) *cursor += size;
+    if (!dag || !shareable(ret)) return ret;
+
+    for (slot = dag->slots + (node_hash(ret) & dag->mask); *slot; slot = dag->slots + ((slot - dag->slots + 1) & dag->mask)) {
+        if (same_node(*slot, ret)) {
+            if (!at) *cursor -= size;
+            return *slot;
+        }
+    }
+    *slot = ret;
+    return ret;
+}
+
+
+#define TE_SCRATCH_SIZE 4096
+
+/* Parses through the given arena, then packs the result into one allocation. */
+static te_expr *compile_packed(state *s, te_arena *arena, int *error) {
+    te_expr *ret = 0;
+    char *cursor;
+
+    s->arena = arena;
+    next_token(s);
+    te_expr *root = list(s);
+
+    if (s->type != TOK_END) {
+        if (error) {
+            *error = (s->next - s->start);
+            if (*error == 0) *error = 1;
+        }
+    } else {
+        te_dag dag;
+        int nodes = 0;
+        size_t size;
+        root = optimize(s, root);
+        size = tree_size(root, &nodes);
+        dag.mask = table_mask(nodes);
+        dag.roots = 0;
+        dag.slots = arena_alloc(arena, sizeof(te_expr*) * (dag.mask + 1));
+        if (dag.slots) memset(dag.slots, 0, sizeof(te_expr*) * (dag.mask + 1));
+        /* The root goes first so the block can be freed through it. */
+        cursor = malloc(size);
+        if (cursor) {
+            ret = (te_expr*)cursor;
+            cursor += node_size(root->type);
+            pack_tree(root, &cursor, dag.slots ? &dag : 0, ret);
+            ret->type |= TE_FLAG_ARENA;
+        }
+        if (error) *error = ret ? 0 : 1;
+    }
+    return ret;
+}
+
+/* compile_packed on a stack buffer that spills to heap blocks. */
+static te_expr *compile_scratch(state *s, int *error) {
+    union {long long align; char bytes[TE_SCRATCH_SIZE];} scratch;
+    te_arena arena;
+    te_expr *ret;
+
+    arena.base = scratch.bytes;
+    arena.used = 0;
+    arena.size = sizeof(scratch);
+    arena.spill = 0;
+    ret = compile_packed(s, &arena, error);
+    arena_release(&arena);
+    return ret;
+}
+
+te_expr *te_compile_arena(const char *expression, const te_variable *variables, int var_count, int *error) {
+    state s;
+    te_symbols *sym = var_count >= TE_HASH_MIN ? symbols_create(variables, var_count, 0) : 0;
+    te_expr *ret;
+    s.start = s.next = expression;
+    s.lookup = variables;
+    s.lookup_len = var_count;
+    s.symbols = sym;
+    s.constants = 0;
+    ret = compile_scratch(&s, error);
+    te_symbols_free(sym);
+    return ret;
+}
+
+te_expr *te_compile_symbols(const char *expression, const te_symbols *symbols, int *error) {
+    state s;
+    s.start = s.next = expression;
+    s.lookup = 0;
+    s.lookup_len = 0;
+    s.symbols = symbols;
+    s.constants = 0;
+    return compile_scratch(&s, error);
+}
+
+
+/* Everything a compile needs that does not depend on the expression. */
+struct te_context {
+    te_symbols *symbols;
+    char *scratch;          /* Arena block reused by every compile; grown when one spills. */
+    size_t scratch_size;
+    Rational constants[sizeof(functions) / sizeof(te_variable)];
+};
+
+te_context *te_context_create(const te_variable *variables, int var_count) {
+    te_context *ctx = malloc(sizeof(te_context));
+    int i;
+    if (!ctx) return 0;
+
+    ctx->symbols = te_symbols_create(variables, var_count);
+    ctx->scratch_size = TE_SCRATCH_SIZE;
+    ctx->scratch = malloc(ctx->scratch_size);
+    if (!ctx->symbols || !ctx->scratch) {
+        te_context_free(ctx);
+        return 0;
+    }
+
+    /* Pure arity-0 builtins are the SI prefixes; their values never change.
+     * The ones that do not fit are left to te_eval_big. */
+    for (i = 0; i < (int)(sizeof(functions) / sizeof(te_variable)); ++i) {
+        ctx->constants[i] = ROVERFLOW();
+        if (functions[i].name && functions[i].type == (TE_FUNCTION0 | TE_FLAG_PURE)) {
+            ctx->constants[i] = ((Rational(*)(void))functions[i].address)();
+        }
+    }
+    return ctx;
+}
+
+te_expr *te_context_compile(te_context *ctx, const char *expression, int *error) {
+    te_arena arena;
+    te_expr *ret;
+    state s;
+
+    s.start = s.next = expression;
+    s.lookup = 0;
+    s.lookup_len = 0;
+    s.symbols = ctx->symbols;
+    s.constants = ctx->constants;
+
+    arena.base = ctx->scratch;
+    arena.used = 0;
+    arena.size = ctx->scratch_size;
+    arena.spill = 0;
+    ret = compile_packed(&s, &arena, error);
+
+    /* Size the block for the largest expression seen so the next one fits. */
+    if (arena.spill) {
+        char *grown = malloc(arena.size * 2);
+        if (grown) {
+            free(ctx->scratch);
+            ctx->scratch = grown;
+            ctx->scratch_size = arena.size * 2;
+        }
+        arena_release(&arena);
+    }
+    return ret;
+}
+
+void te_context_free(te_context *ctx) {
+    if (!ctx) return;
+    te_symbols_free(ctx->symbols);
+    free(ctx->scratch);
+    free(ctx);
+}
+
+/* Parallel compile. The symbol table and interned constants are shared
+ * read-only; each worker has its own scratch arena. Entries are dealt out as
+ * one contiguous range per worker, which the owner consumes from the front a
+ * few at a time; a worker that runs dry steals the back half of the largest
+ * range left. Ranges have their own locks, so owners rarely contend. */
+
+/* Entries an owner takes from its own range at a time. */
+#define TE_COMPILE_GRAIN 16
+
+typedef struct te_range {
+#ifdef TE_THREADS
+    te_lock lock;
+#endif
+    int begin, end;
+} te_range;
+
+typedef struct te_compiler {
+    te_context ctx;         /* Shares symbols and constants; its own scratch. */
+    te_range *ranges;
+    int self, workers;
+    const char *const *expressions;
+    te_expr **out;
+    int *errors;
+} te_compiler;
+
+static int range_take(te_range *r, int *begin) {
+    int end;
+#ifdef TE_THREADS
+    lock_take(&r->lock);
+#endif
+    *begin = r->begin;
+    end = r->begin + TE_COMPILE_GRAIN < r->end ? r->begin + TE_COMPILE_GRAIN : r->end;
+    r->begin = end;
+#ifdef TE_THREADS
+    lock_give(&r->lock);
+#endif
+    return end;
+}
+
+/* Moves the back half of the fullest other range into the worker's own. */
+static int range_steal(te_compiler *c) {
+#ifdef TE_THREADS
+    te_range *victim = 0;
+    int i, n, left = 0, half, start;
+    for (i = 0; i < c->workers; ++i) {
+        if (i == c->self) continue;
+        lock_take(&c->ranges[i].lock);
+        n = c->ranges[i].end - c->ranges[i].begin;
+        lock_give(&c->ranges[i].lock);
+        if (n > left) {
+            left = n;
+            victim = c->ranges + i;
+        }
+    }
+    if (!victim) return 0;
+    lock_take(&victim->lock);
+    left = victim->end - victim->begin;
+    half = left > 1 ? left / 2 : left;
+    victim->end -= half;
+    /* Other thieves may move victim->end as soon as the lock is given up. */
+    start = victim->end;
+    lock_give(&victim->lock);
+    if (!half) return 1;    /* Lost a race; look again. */
+
+    lock_take(&c->ranges[c->self].lock);
+    c->ranges[c->self].begin = start;
+    c->ranges[c->self].end = start + half;
+    lock_give(&c->ranges[c->self].lock);
+    return 1;
+#else
+    (void)c;
+    return 0;
+#endif
+}
+
+static void compile_range(te_compiler *c) {
+    te_range *own = c->ranges + c->self;
+    for (;;) {
+        int i, end = range_take(own, &i);
+        if (i >= end) {
+            if (!range_steal(c)) return;
+            continue;
+        }
+        for (; i < end; ++i) {
+            int error = 0;
+            c->out[i] = c->expressions[i] ? te_context_compile(&c->ctx, c->expressions[i], &error) : 0;
+            if (c->errors) c->errors[i] = c->expressions[i] ? error : 1;
+        }
+    }
+}
+
+#ifdef TE_THREADS
+#ifdef _WIN32
+static DWORD WINAPI compile_thread(LPVOID arg) {
+    compile_range(arg);
+    return 0;
+}
+static int thread_start(te_thread *t, te_compiler *c) {
+    *t = CreateThread(0, 0, compile_thread, c, 0, 0);
+    return *t != 0;
+}
+static void thread_join(te_thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+static int cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+#else
+static void *compile_thread(void *arg) {
+    compile_range(arg);
+    return 0;
+}
+static int thread_start(te_thread *t, te_compiler *c) {
+    return pthread_create(t, 0, compile_thread, c) == 0;
+}
+static void thread_join(te_thread t) {
+    pthread_join(t, 0);
+}
+static int cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    return 1;
+#endif
+}
+#endif
+#endif
+
+int te_compile_many(const char *const *expressions, int count, const te_variable *variables, int var_count,
+        int threads, te_expr **out, int *errors) {
+    te_context *shared;
+    te_compiler *workers;
+    te_range *ranges;
+#ifdef TE_THREADS
+    te_thread *handles;
+    int started = 1;
+#endif
+    int i, ready = 0, failed = 0;
+
+    if (count <= 0) return 0;
+    /* Every entry reads as failed until a worker compiles it. */
+    for (i = 0; i < count; ++i) {
+        out[i] = 0;
+        if (errors) errors[i] = 1;
+    }
+#ifdef TE_THREADS
+    if (threads <= 0) threads = cpu_count();
+#else
+    threads = 1;
+#endif
+    /* Not worth a thread for less than a few grains each. */
+    if (threads > count / (4 * TE_COMPILE_GRAIN)) threads = count / (4 * TE_COMPILE_GRAIN);
+    if (threads < 1) threads = 1;
+
+    shared = te_context_create(variables, var_count);
+    workers = calloc(threads, sizeof(te_compiler));
+    ranges = calloc(threads, sizeof(te_range));
+#ifdef TE_THREADS
+    handles = calloc(threads, sizeof(te_thread));
+    if (!handles) failed = 1;
+#endif
+    if (!shared || !workers || !ranges) failed = 1;
+
+    for (; ready < threads && !failed; ++ready) {
+        te_compiler *c = workers + ready;
+        i = ready;
+        c->ctx = *shared;
+        c->ctx.scratch = i ? malloc(shared->scratch_size) : shared->scratch;
+        if (!c->ctx.scratch) {
+            failed = 1;
+            break;
+        }
+        c->ranges = ranges;
+        c->self = i;
+        c->workers = threads;
+        c->expressions = expressions;
+        c->out = out;
+        c->errors = errors;
+        ranges[i].begin = (int)((long long)count * i / threads);
+        ranges[i].end = (int)((long long)count * (i + 1) / threads);
+#ifdef TE_THREADS
+        lock_init(&ranges[i].lock);
+#endif
+    }
+
+    if (!failed) {
+#ifdef TE_THREADS
+        /* The calling thread is worker 0. A worker that cannot start leaves
+         * its range to be stolen. */
+        for (i = 1; i < threads; ++i) {
+            if (!thread_start(handles + i, workers + i)) break;
+            ++started;
+        }
+#endif
+        compile_range(workers);
+#ifdef TE_THREADS
+        for (i = 1; i < started; ++i) thread_join(handles[i]);
+#endif
+    }
+
+    for (i = 0; i < ready; ++i) {
+        /* Scratch may have been regrown; worker 0's replaces the shared one. */
+        if (i == 0) shared->scratch = workers[0].ctx.scratch;
+        else free(workers[i].ctx.scratch);
+#ifdef TE_THREADS
+        lock_free(&ranges[i].lock);
+#endif
+    }
+    if (failed) {
+        for (i = 0; i < count; ++i) out[i] = 0;
+    }
+#ifdef TE_THREADS
+    free(handles);
+#endif
+    free(ranges);
+    free(workers);
+    te_context_free(shared);
+    return failed ? -1 : 0;
+}
+
+Rational te_interp(const char *expression, int *error) {
+    te_expr *n = te_compile_arena(expression, 0, 0, error);
+    Rational ret;
+    if (n) {
+        ret = te_eval(n);
+        te_free(n);
+    } else {
+        ret = RNAN();
+    }
+    return ret;
+}
+
+/* Flat evaluation: the optimized tree is lowered to post-order instructions
+ * that run over a value stack, so evaluation needs no recursion. */
+
+enum {
+    OP_CONSTANT, OP_VARIABLE,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIVIDE, OP_NEGATE, OP_COMMA,
+    OP_FUNCTION, OP_CLOSURE,
+    OP_STORE, OP_LOAD,  /* Copy the top of the stack to a slot, push a slot. */
+    OP_DFUNCTION        /* A double function; only in te_numeric's double instructions. */
+};
+
+typedef struct te_op {
+    int code;
+    short arity;
+    short pure;     /* A call to a function flagged TE_FLAG_PURE. */
+    union {Rational value; double number; const Rational *bound; const void *function; int slot;};
+    void *context;
+} te_op;
+
+struct te_bytecode {
+    int count;      /* Number of instructions. */
+    int depth;      /* Deepest value stack the instructions need. */
+    int slots;      /* Values kept for nodes a DAG shares. */
+    te_op ops[1];
+};
+
+
+static int tree_count(const te_expr *n) {
+    int count = 1, i;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        count += tree_count(n->parameters[i]);
+    }
+    return count;
+}
+
+/* References to each node of a packed DAG. A call reached more than once
+ * is computed on first use, stored to a slot, and loaded after that. */
+typedef struct te_ref {
+    const te_expr *node;
+    int uses;
+    int slot;
+} te_ref;
+
+typedef struct te_refs {
+    te_ref *refs;
+    unsigned mask;
+    int slots;
+} te_refs;
+
+static unsigned address_hash(const void *p) {
+    return (unsigned)(((size_t)p >> 3) * 0x9E3779B1u);
+}
+
+static te_ref *find_ref(te_refs *r, const te_expr *n) {
+    unsigned h = address_hash(n) & r->mask;
+    while (r->refs[h].node && r->refs[h].node != n) h = (h + 1) & r->mask;
+    if (!r->refs[h].node) {
+        r->refs[h].node = n;
+        r->refs[h].slot = -1;
+    }
+    return r->refs + h;
+}
+
+/* Counts references and returns how many instructions n lowers to. */
+static int count_refs(te_refs *r, const te_expr *n) {
+    te_ref *ref = find_ref(r, n);
+    int count = 1, i;
+    if (ref->uses++) return 1;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        count += count_refs(r, n->parameters[i]);
+    }
+    return count;
+}
+
+static int is_call(const te_expr *n) {
+    return IS_FUNCTION(n->type) || IS_CLOSURE(n->type);
+}
+
+/* Appends n in post-order and returns the stack depth it needs. */
+static int lower(const te_expr *n, te_op **out, te_refs *r) {
+    const int arity = ARITY(n->type);
+    te_ref *ref = find_ref(r, n);
+    int depth = 1, i;
+    te_op *op;
+
+    if (ref->slot >= 0) {
+        op = (*out)++;
+        op->code = OP_LOAD;
+        op->arity = 0;
+        op->pure = 0;
+        op->slot = ref->slot;
+        op->context = 0;
+        return 1;
+    }
+
+    for (i = 0; i < arity; ++i) {
+        const int d = i + lower(n->parameters[i], out, r);
+        if (d > depth) depth = d;
+    }
+
+    op = (*out)++;
+    op->arity = arity;
+    op->pure = is_call(n) && IS_PURE(n->type);
+    op->context = 0;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: op->code = OP_CONSTANT; op->value = n->value; break;
+        case TE_VARIABLE: op->code = OP_VARIABLE; op->bound = n->bound; break;
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+            op->function = n->function;
+            if (arity == 2 && n->function == add) op->code = OP_ADD;
+            else if (arity == 2 && n->function == sub) op->code = OP_SUB;
+            else if (arity == 2 && n->function == mul) op->code = OP_MUL;
+            else if (arity == 2 && n->function == divide) op->code = OP_DIVIDE;
+            else if (arity == 2 && n->function == comma) op->code = OP_COMMA;
+            else if (arity == 1 && n->function == negate) op->code = OP_NEGATE;
+            else op->code = OP_FUNCTION;
+            break;
+
+        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            op->code = OP_CLOSURE;
+            op->function = n->function;
+            op->context = n->parameters[arity];
+            break;
+
+        default:
+            op->code = OP_CONSTANT;
+            op->value = RNAN();
+            break;
+    }
+
+    if (ref->uses > 1 && is_call(n)) {
+        ref->slot = r->slots++;
+        op = (*out)++;
+        op->code = OP_STORE;
+        op->arity = 0;
+        op->pure = 0;
+        op->slot = ref->slot;
+        op->context = 0;
+    }
+
+    return depth;
+}
+
+
+/* Lowers n, a DAG of at most size distinct nodes. Each of outputs (nodes of
+ * n) that is a call also gets a slot, returned in slots, so its value can be
+ * read after evaluation. */
+static te_bytecode *bytecode_compile(const te_expr *n, int size, te_expr *const *outputs, int output_count, int *slots) {
+    te_bytecode *ret;
+    te_refs r;
+    te_op *out;
+    unsigned i;
+    int count, k;
+
+    if (!n) return 0;
+    r.mask = table_mask(size);
+    r.refs = calloc(r.mask + 1, sizeof(te_ref));
+    r.slots = 0;
+    if (!r.refs) return 0;
+
+    count = count_refs(&r, n);
+    for (k = 0; k < output_count; ++k) ++find_ref(&r, outputs[k])->uses;
+    for (i = 0; i <= r.mask; ++i) {
+        if (r.refs[i].uses > 1 && is_call(r.refs[i].node)) ++count;
+    }
+
+    ret = malloc(sizeof(te_bytecode) + sizeof(te_op) * (count - 1));
+    if (ret) {
+        out = ret->ops;
+        ret->depth = lower(n, &out, &r);
+        ret->count = count;
+        ret->slots = r.slots;
+        for (k = 0; k < output_count; ++k) slots[k] = find_ref(&r, outputs[k])->slot;
+    }
+    free(r.refs);
+    return ret;
+}
+
+te_bytecode *te_bytecode_compile(const te_expr *n) {
+    return n ? bytecode_compile(n, tree_count(n), 0, 0, 0) : 0;
+}
+
+
+#define TE_STACK_SIZE 64
+#define TE_FUN(...) ((Rational(*)(__VA_ARGS__))op->function)
+#define A(e) args[e]
+
+/* Calls the function of an OP_FUNCTION or OP_CLOSURE instruction. */
+static Rational call_op(const te_op *op, const Rational *args) {
+    if (op->code == OP_CLOSURE) {
+        switch (op->arity) {
+            case 0: return TE_FUN(void*)(op->context);
+            case 1: return TE_FUN(void*, Rational)(op->context, A(0));
+            case 2: return TE_FUN(void*, Rational, Rational)(op->context, A(0), A(1));
+            case 3: return TE_FUN(void*, Rational, Rational, Rational)(op->context, A(0), A(1), A(2));
+            case 4: return TE_FUN(void*, Rational, Rational, Rational, Rational)(op->context, A(0), A(1), A(2), A(3));
+            case 5: return TE_FUN(void*, Rational, Rational, Rational, Rational, Rational)(op->context, A(0), A(1), A(2), A(3), A(4));
+            case 6: return TE_FUN(void*, Rational, Rational, Rational, Rational, Rational, Rational)(op->context, A(0), A(1), A(2), A(3), A(4), A(5));
+            case 7: return TE_FUN(void*, Rational, Rational, Rational, Rational, Rational, Rational, Rational)(op->context, A(0), A(1), A(2), A(3), A(4), A(5), A(6));
+            default: return RNAN();
+        }
+    }
+
+    switch (op->arity) {
+        case 0: return TE_FUN(void)();
+        case 1: return TE_FUN(Rational)(A(0));
+        case 2: return TE_FUN(Rational, Rational)(A(0), A(1));
+        case 3: return TE_FUN(Rational, Rational, Rational)(A(0), A(1), A(2));
+        case 4: return TE_FUN(Rational, Rational, Rational, Rational)(A(0), A(1), A(2), A(3));
+        case 5: return TE_FUN(Rational, Rational, Rational, Rational, Rational)(A(0), A(1), A(2), A(3), A(4));
+        case 6: return TE_FUN(Rational, Rational, Rational, Rational, Rational, Rational)(A(0), A(1), A(2), A(3), A(4), A(5));
+        case 7: return TE_FUN(Rational, Rational, Rational, Rational, Rational, Rational, Rational)(A(0), A(1), A(2), A(3), A(4), A(5), A(6));
+        default: return RNAN();
+    }
+}
+
+#undef TE_FUN
+#undef A
+
+
+/* Runs the instructions on stack, which has room for depth + slots values.
+ * Slots for shared nodes sit above the stack and keep their values after. */
+static Rational bytecode_run(const te_bytecode *b, Rational *stack) {
+    Rational *sp = stack - 1, *slots = stack + b->depth;
+    const te_op *op, *end;
+
+    for (op = b->ops, end = b->ops + b->count; op != end; ++op) {
+        switch (op->code) {
+            case OP_CONSTANT: *++sp = op->value; break;
+            case OP_VARIABLE: *++sp = *op->bound; break;
+            case OP_ADD: --sp; sp[0] = add(sp[0], sp[1]); break;
+            case OP_SUB: --sp; sp[0] = sub(sp[0], sp[1]); break;
+            case OP_MUL: --sp; sp[0] = mul(sp[0], sp[1]); break;
+            case OP_DIVIDE: --sp; sp[0] = divide(sp[0], sp[1]); break;
+            case OP_COMMA: --sp; sp[0] = sp[1]; break;
+            case OP_NEGATE: sp[0] = negate(sp[0]); break;
+            case OP_STORE: slots[op->slot] = sp[0]; break;
+            case OP_LOAD: *++sp = slots[op->slot]; break;
+
+            case OP_FUNCTION:
+            case OP_CLOSURE:
+                /* Arguments occupy the top `arity` slots; the result replaces the first one. */
+                sp -= op->arity - 1;
+                sp[0] = call_op(op, sp);
+                break;
+        }
+    }
+    return sp[0];
+}
+
+Rational te_bytecode_eval(const te_bytecode *b) {
+    Rational local[TE_STACK_SIZE];
+    Rational *stack, ret;
+
+    if (!b) return RNAN();
+    stack = b->depth + b->slots <= TE_STACK_SIZE ? local : malloc(sizeof(Rational) * (b->depth + b->slots));
+    if (!stack) return RNAN();
+    ret = bytecode_run(b, stack);
+    if (stack != local) free(stack);
+    return ret;
+}
+
+
+/* Lazy evaluation leaves intermediates unreduced. Each operator forms its
+ * result exactly in 128 bits and only divides out the gcd when the result
+ * would not fit back into a Rational; the final value is reduced once. */
+
+#ifdef __SIZEOF_INT128__
+typedef __int128 te_wide;
+
+static int ctz_wide(unsigned __int128 x) {
+    const unsigned long long low = (unsigned long long)x;
+    return low ? __builtin_ctzll(low) : 64 + __builtin_ctzll((unsigned long long)(x >> 64));
+}
+
+static unsigned __int128 gcd_wide(unsigned __int128 u, unsigned __int128 v) {
+    int shift;
+    if (!u) return v;
+    if (!v) return u;
+    shift = ctz_wide(u | v);
+    u >>= ctz_wide(u);
+    do {
+        v >>= ctz_wide(v);
+        if (u > v) {
+            unsigned __int128 t = u;
+            u = v;
+            v = t;
+        }
+        v -= u;
+    } while (v);
+    return u << shift;
+}
+
+static Rational settle(te_wide num, te_wide den) {
+    Rational result;
+    if (den == 0) return ROVERFLOW();
+    if (den < 0) {
+        num = -num;
+        den = -den;
+    }
+    if (num > LLONG_MAX || num < -LLONG_MAX || den > LLONG_MAX) {
+        const te_wide g = (te_wide)gcd_wide(num < 0 ? -num : num, den);
+        num /= g;
+        den /= g;
+        if (num > LLONG_MAX || num < -LLONG_MAX || den > LLONG_MAX) return ROVERFLOW();
+    }
+    result.numerator = (long long)num;
+    result.denominator = (long long)den;
+    return result;
+}
+
+Rational te_bytecode_eval_lazy(const te_bytecode *b) {
+    Rational local[TE_STACK_SIZE];
+    Rational *stack, *sp, *slots;
+    const te_op *op, *end;
+    Rational ret;
+    int i;
+
+    if (!b) return RNAN();
+    /* Slots for shared nodes sit above the stack. */
+    stack = b->depth + b->slots <= TE_STACK_SIZE ? local : malloc(sizeof(Rational) * (b->depth + b->slots));
+    if (!stack) return RNAN();
+    slots = stack + b->depth;
+    sp = stack - 1;
+
+#define N(e) ((te_wide)sp[e].numerator)
+#define D(e) ((te_wide)sp[e].denominator)
+    for (op = b->ops, end = b->ops + b->count; op != end; ++op) {
+        switch (op->code) {
+            case OP_CONSTANT: *++sp = op->value; break;
+            case OP_VARIABLE: *++sp = *op->bound; break;
+            case OP_ADD: --sp; sp[0] = settle(N(0) * D(1) + N(1) * D(0), D(0) * D(1)); break;
+            case OP_SUB: --sp; sp[0] = settle(N(0) * D(1) - N(1) * D(0), D(0) * D(1)); break;
+            case OP_MUL: --sp; sp[0] = settle(N(0) * N(1), D(0) * D(1)); break;
+            case OP_DIVIDE: --sp; sp[0] = settle(N(0) * D(1), D(0) * N(1)); break;
+            case OP_COMMA: --sp; sp[0] = sp[1]; break;
+            case OP_NEGATE: sp[0] = negate(sp[0]); break;
+            case OP_STORE: slots[op->slot] = sp[0]; break;
+            case OP_LOAD: *++sp = slots[op->slot]; break;
+
+            case OP_FUNCTION:
+            case OP_CLOSURE:
+                /* Other functions expect reduced arguments. */
+                sp -= op->arity - 1;
+                for (i = 0; i < op->arity; ++i) {
+                    sp[i] = reduce(sp[i].numerator, sp[i].denominator);
+                }
+                sp[0] = call_op(op, sp);
+                break;
+        }
+    }
+#undef N
+#undef D
+
+    ret = reduce(sp[0].numerator, sp[0].denominator);
+    if (stack != local) free(stack);
+    return ret;
+}
+#else
+Rational te_bytecode_eval_lazy(const te_bytecode *b) {
+    /* Without a 128-bit type there is nothing to defer into. */
+    return te_bytecode_eval(b);
+}
+#endif
+
+
+void te_bytecode_free(te_bytecode *b) {
+    free(b);
+}
+
+
+/* Numeric backends. te_numeric_compile lowers once and picks the loop that
+ * will run: the Rational instructions, a copy of them over doubles, or the
+ * double copy with the Rational ones behind it. The copy has builtins
+ * swapped for their double versions; other calls keep their Rational
+ * signatures and go through approximate() for their arguments. */
+
+static double dfac(double a) {
+    double result = 1;
+    if (a < 0 || a != floor(a)) return NAN;
+    for (; a > 1 && result < HUGE_VAL; --a) result *= a;
+    return result;
+}
+
+static double dncr(double n, double r) {
+    double result = 1, i;
+    if (r < 0 || n < r || n != floor(n) || r != floor(r)) return NAN;
+    if (r > n / 2) r = n - r;
+    for (i = 1; i <= r; ++i) result = result * (n - r + i) / i;
+    return floor(result + 0.5);
+}
+
+static double dnpr(double n, double r) {return dncr(n, r) * dfac(r);}
+static double dtenpow(double a, double b) {return a * pow(10, b);}
+
+/* The prefixes that only overflow as Rationals. */
+static double dY(void) {return 1e24;}
+static double dZ(void) {return 1e21;}
+static double dy(void) {return 1e-24;}
+static double dz(void) {return 1e-21;}
+
+static const struct {const void *exact, *approx;} doubles[] = {
+    {rabs, fabs}, {racos, acos}, {rasin, asin}, {ratan, atan}, {ratan2, atan2},
+    {rceil, ceil}, {rcos, cos}, {rcosh, cosh}, {rexp, exp}, {fac, dfac},
+    {rfloor, floor}, {rln, log}, {rlog10, log10}, {rmod, fmod}, {ncr, dncr},
+    {npr, dnpr}, {rpow, pow}, {rsin, sin}, {rsinh, sinh}, {rsqrt, sqrt},
+    {rtan, tan}, {rtanh, tanh}, {tenpow, dtenpow},
+    {Y, dY}, {Z, dZ}, {y, dy}, {z, dz}
+};
+
+struct te_numeric {
+    double (*run)(const te_numeric *num);
+    te_bytecode *exact;     /* TE_EXACT and TE_MIXED. */
+    te_bytecode *approx;    /* TE_DOUBLE and TE_MIXED: constants in number, OP_DFUNCTION calls. */
+};
+
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))op->function)
+#define A(e) args[e]
+
+static double call_double(const te_op *op, const double *args) {
+    switch (op->arity) {
+        case 0: return TE_FUN(void)();
+        case 1: return TE_FUN(double)(A(0));
+        case 2: return TE_FUN(double, double)(A(0), A(1));
+        default: return NAN;
+    }
+}
+
+#undef TE_FUN
+#undef A
+
+/* Calls a function without a double version. */
+static double call_rational(const te_op *op, const double *args) {
+    Rational r[7];
+    int i;
+    for (i = 0; i < op->arity; ++i) r[i] = approximate(args[i]);
+    return to_double(call_op(op, r));
+}
+
+static double double_run(const te_bytecode *b, double *stack) {
+    double *sp = stack - 1, *slots = stack + b->depth;
+    const te_op *op, *end;
+
+    for (op = b->ops, end = b->ops + b->count; op != end; ++op) {
+        switch (op->code) {
+            case OP_CONSTANT: *++sp = op->number; break;
+            case OP_VARIABLE: *++sp = to_double(*op->bound); break;
+            case OP_ADD: --sp; sp[0] += sp[1]; break;
+            case OP_SUB: --sp; sp[0] -= sp[1]; break;
+            case OP_MUL: --sp; sp[0] *= sp[1]; break;
+            case OP_DIVIDE: --sp; sp[0] /= sp[1]; break;
+            case OP_COMMA: --sp; sp[0] = sp[1]; break;
+            case OP_NEGATE: sp[0] = -sp[0]; break;
+            case OP_STORE: slots[op->slot] = sp[0]; break;
+            case OP_LOAD: *++sp = slots[op->slot]; break;
+
+            case OP_DFUNCTION:
+                sp -= op->arity - 1;
+                sp[0] = call_double(op, sp);
+                break;
+
+            case OP_FUNCTION:
+            case OP_CLOSURE:
+                sp -= op->arity - 1;
+                sp[0] = call_rational(op, sp);
+                break;
+        }
+    }
+    return sp[0];
+}
+
+static double numeric_exact(const te_numeric *num) {
+    return to_double(te_bytecode_eval(num->exact));
+}
+
+static double numeric_double(const te_numeric *num) {
+    const te_bytecode *b = num->approx;
+    double local[TE_STACK_SIZE];
+    double *stack, ret;
+
+    stack = b->depth + b->slots <= TE_STACK_SIZE ? local : malloc(sizeof(double) * (b->depth + b->slots));
+    if (!stack) return NAN;
+    ret = double_run(b, stack);
+    if (stack != local) free(stack);
+    /* Infinities are not representable either, as in the exact mode. */
+    return isfinite(ret) ? ret : NAN;
+}
+
+/* Past 2^53 a double no longer holds every integer. */
+#define TE_DOUBLE_EXACT 9007199254740992.0
+
+/* Doubles first; Rationals only when the double result is not finite or
+ * is too large for doubles to be exact, and only if they can do better. */
+static double numeric_mixed(const te_numeric *num) {
+    const double d = numeric_double(num);
+    Rational r;
+    if (fabs(d) < TE_DOUBLE_EXACT) return d;
+    r = te_bytecode_eval(num->exact);
+    return r.denominator ? to_double(r) : d;
+}
+
+/* Rewrites lowered instructions to run over doubles. */
+static void lower_double(te_bytecode *b) {
+    int i, k;
+    for (i = 0; i < b->count; ++i) {
+        te_op *op = b->ops + i;
+        if (op->code == OP_CONSTANT) {
+            op->number = to_double(op->value);
+        } else if (op->code == OP_FUNCTION) {
+            for (k = 0; k < (int)(sizeof(doubles) / sizeof(doubles[0])); ++k) {
+                if (doubles[k].exact == op->function) {
+                    op->code = OP_DFUNCTION;
+                    op->function = doubles[k].approx;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+te_numeric *te_numeric_compile(const te_expr *n, int mode) {
+    te_numeric *num = calloc(1, sizeof(te_numeric));
+    if (!num || !n) {
+        free(num);
+        return 0;
+    }
+    switch (mode) {
+        case TE_EXACT: num->run = numeric_exact; break;
+        case TE_DOUBLE: num->run = numeric_double; break;
+        case TE_MIXED: num->run = numeric_mixed; break;
+        default: free(num); return 0;
+    }
+    if (mode != TE_DOUBLE && !(num->exact = te_bytecode_compile(n))) goto fail;
+    if (mode != TE_EXACT) {
+        if (!(num->approx = te_bytecode_compile(n))) goto fail;
+        lower_double(num->approx);
+    }
+    return num;
+
+fail:
+    te_numeric_free(num);
+    return 0;
+}
+
+double te_numeric_eval(const te_numeric *num) {
+    return num ? num->run(num) : NAN;
+}
+
+void te_numeric_free(te_numeric *num) {
+    if (!num) return;
+    te_bytecode_free(num->exact);
+    te_bytecode_free(num->approx);
+    free(num);
+}
+
+
+/* Native code. Each instruction becomes straight-line x86-64 working on a
+ * frame that mirrors the bytecode's value stack. add/sub/mul/negate on
+ * integers run inline with an overflow check; everything else, and any
+ * inline step that overflows, calls the same C function the interpreter
+ * would. Elsewhere te_jit_compile keeps the bytecode and te_jit_eval
+ * interprets it. */
+
+#if !defined(TE_NO_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef MAP_ANONYMOUS
+#define TE_JIT
+#endif
+#endif
+
+struct te_jit {
+    te_bytecode *code;      /* Kept for call_op's te_op pointers, and as the fallback. */
+    te_native native;       /* NULL when interpreting. */
+    void *page;
+    size_t size;
+};
+
+#ifdef TE_JIT
+
+/* Generous upper bound on the bytes one instruction emits. */
+#define TE_JIT_OP_BYTES 160
+
+/* The frame is allocated this much at a time, touching each step. */
+#define TE_JIT_PAGE 4096
+
+enum {RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7};
+enum {CC_O = 0x0, CC_NE = 0x5};
+
+static void put8(unsigned char **p, int byte) {*(*p)++ = (unsigned char)byte;}
+
+static void put32(unsigned char **p, int value) {
+    memcpy(*p, &value, 4);
+    *p += 4;
+}
+
+static void put64(unsigned char **p, long long value) {
+    memcpy(*p, &value, 8);
+    *p += 8;
+}
+
+/* opcode reg, [rsp + disp] (or the reverse, by opcode), 64-bit. */
+static void put_frame(unsigned char **p, int opcode, int reg, int disp) {
+    put8(p, 0x48);
+    if (opcode > 0xFF) put8(p, opcode >> 8);
+    put8(p, opcode & 0xFF);
+    put8(p, 0x84 | (reg << 3));
+    put8(p, 0x24);
+    put32(p, disp);
+}
+
+#define LOAD(p, reg, disp) put_frame(p, 0x8B, reg, disp)
+#define STORE(p, reg, disp) put_frame(p, 0x89, reg, disp)
+
+static void put_imm(unsigned char **p, int reg, long long value) {
+    put8(p, 0x48);
+    put8(p, 0xB8 + reg);
+    put64(p, value);
+}
+
+static void put_call(unsigned char **p, const void *function) {
+    put_imm(p, RAX, (long long)(size_t)function);
+    put8(p, 0xFF);
+    put8(p, 0xD0);
+}
+
+/* cmp qword [rsp + disp], 1 */
+static void put_is_one(unsigned char **p, int disp) {
+    put8(p, 0x48);
+    put8(p, 0x83);
+    put8(p, 0xBC);
+    put8(p, 0x24);
+    put32(p, disp);
+    put8(p, 1);
+}
+
+/* Emits a jump and returns where its target is patched in. */
+static unsigned char *put_jump(unsigned char **p, int cc) {
+    if (cc < 0) {
+        put8(p, 0xE9);
+    } else {
+        put8(p, 0x0F);
+        put8(p, 0x80 + cc);
+    }
+    put32(p, 0);
+    return *p - 4;
+}
+
+static void patch(unsigned char *at, const unsigned char *target) {
+    const int rel = (int)(target - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+#define NUM(i) ((i) * 16)
+#define DEN(i) ((i) * 16 + 8)
+
+/* Calls a Rational (Rational, Rational) function on frame entries a and b,
+ * leaving the result in a. SysV passes each Rational in a register pair and
+ * returns one in rax:rdx. */
+static void put_call2(unsigned char **p, const void *function, int a, int b) {
+    LOAD(p, RDI, NUM(a));
+    LOAD(p, RSI, DEN(a));
+    LOAD(p, RDX, NUM(b));
+    LOAD(p, RCX, DEN(b));
+    put_call(p, function);
+    STORE(p, RAX, NUM(a));
+    STORE(p, RDX, DEN(a));
+}
+
+/* add/sub/mul of integers inline: both denominators 1 and no overflow,
+ * otherwise the C function. */
+static void put_arith(unsigned char **p, int opcode, const void *function, int a, int b) {
+    unsigned char *slow[3], *done;
+    int i;
+    put_is_one(p, DEN(a));
+    slow[0] = put_jump(p, CC_NE);
+    put_is_one(p, DEN(b));
+    slow[1] = put_jump(p, CC_NE);
+    LOAD(p, RAX, NUM(a));
+    put_frame(p, opcode, RAX, NUM(b));
+    slow[2] = put_jump(p, CC_O);
+    STORE(p, RAX, NUM(a));
+    done = put_jump(p, -1);
+    for (i = 0; i < 3; ++i) patch(slow[i], *p);
+    put_call2(p, function, a, b);
+    patch(done, *p);
+}
+
+static void put_copy(unsigned char **p, int from, int to) {
+    LOAD(p, RAX, NUM(from));
+    STORE(p, RAX, NUM(to));
+    LOAD(p, RAX, DEN(from));
+    STORE(p, RAX, DEN(to));
+}
+
+static int jit_frame(const te_bytecode *b) {
+    return ((b->depth + b->slots) * 16 + 15) & ~15;
+}
+
+/* Returns the end of the emitted code. */
+static unsigned char *jit_emit(const te_bytecode *b, unsigned char *p) {
+    int i, left, top = -1;
+
+    /* push rbp; mov rbp, rsp */
+    put8(&p, 0x55);
+    put8(&p, 0x48); put8(&p, 0x89); put8(&p, 0xE5);
+    /* sub rsp, frame a page at a time, with or qword [rsp], 0 after each so
+     * a large frame cannot step over the guard page. rsp stays 16-byte
+     * aligned for calls. */
+    for (left = jit_frame(b); left > 0; left -= TE_JIT_PAGE) {
+        put8(&p, 0x48); put8(&p, 0x81); put8(&p, 0xEC); put32(&p, left < TE_JIT_PAGE ? left : TE_JIT_PAGE);
+        put8(&p, 0x48); put8(&p, 0x83); put8(&p, 0x0C); put8(&p, 0x24); put8(&p, 0x00);
+    }
+
+    for (i = 0; i < b->count; ++i) {
+        const te_op *op = b->ops + i;
+        switch (op->code) {
+            case OP_CONSTANT:
+                ++top;
+                put_imm(&p, RAX, op->value.numerator);
+                STORE(&p, RAX, NUM(top));
+                put_imm(&p, RAX, op->value.denominator);
+                STORE(&p, RAX, DEN(top));
+                break;
+
+            case OP_VARIABLE:
+                ++top;
+                /* mov rcx, bound; mov rax, [rcx]; mov rdx, [rcx + 8] */
+                put_imm(&p, RCX, (long long)(size_t)op->bound);
+                put8(&p, 0x48); put8(&p, 0x8B); put8(&p, 0x01);
+                put8(&p, 0x48); put8(&p, 0x8B); put8(&p, 0x51); put8(&p, 0x08);
+                STORE(&p, RAX, NUM(top));
+                STORE(&p, RDX, DEN(top));
+                break;
+
+            case OP_ADD: --top; put_arith(&p, 0x03, add, top, top + 1); break;
+            case OP_SUB: --top; put_arith(&p, 0x2B, sub, top, top + 1); break;
+            case OP_MUL: --top; put_arith(&p, 0x0FAF, mul, top, top + 1); break;
+            case OP_DIVIDE: --top; put_call2(&p, divide, top, top + 1); break;
+            case OP_COMMA: --top; put_copy(&p, top + 1, top); break;
+
+            case OP_NEGATE: {
+                unsigned char *slow, *done;
+                /* mov rax, num; neg rax; jo slow -- only LLONG_MIN overflows. */
+                LOAD(&p, RAX, NUM(top));
+                put8(&p, 0x48); put8(&p, 0xF7); put8(&p, 0xD8);
+                slow = put_jump(&p, CC_O);
+                STORE(&p, RAX, NUM(top));
+                done = put_jump(&p, -1);
+                patch(slow, p);
+                LOAD(&p, RDI, NUM(top));
+                LOAD(&p, RSI, DEN(top));
+                put_call(&p, negate);
+                STORE(&p, RAX, NUM(top));
+                STORE(&p, RDX, DEN(top));
+                patch(done, p);
+                break;
+            }
+
+            case OP_STORE: put_copy(&p, top, b->depth + op->slot); break;
+            case OP_LOAD: ++top; put_copy(&p, b->depth + op->slot, top); break;
+
+            case OP_FUNCTION:
+            case OP_CLOSURE:
+                /* call_op(op, &frame[first argument]) */
+                top -= op->arity - 1;
+                put_imm(&p, RDI, (long long)(size_t)op);
+                put8(&p, 0x48); put8(&p, 0x8D); put8(&p, 0x84 | (RSI << 3)); put8(&p, 0x24); put32(&p, NUM(top));
+                put_call(&p, call_op);
+                STORE(&p, RAX, NUM(top));
+                STORE(&p, RDX, DEN(top));
+                break;
+        }
+    }
+
+    /* Return frame[0] in rax:rdx; mov rsp, rbp; pop rbp; ret */
+    LOAD(&p, RAX, NUM(0));
+    LOAD(&p, RDX, DEN(0));
+    put8(&p, 0x48); put8(&p, 0x89); put8(&p, 0xEC);
+    put8(&p, 0x5D);
+    put8(&p, 0xC3);
+    return p;
+}
+
+#undef NUM
+#undef DEN
+#undef LOAD
+#undef STORE
+
+static void jit_native(te_jit *j) {
+    const size_t size = 64 + (size_t)j->code->count * TE_JIT_OP_BYTES + (size_t)(jit_frame(j->code) / TE_JIT_PAGE) * 12;
+    void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return;
+    jit_emit(j->code, mem);
+    /* Never writable and executable at once. */
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return;
+    }
+    j->page = mem;
+    j->size = size;
+    memcpy(&j->native, &mem, sizeof(mem));
+}
+#endif
+
+
+te_jit *te_jit_compile(const te_expr *n) {
+    te_jit *j;
+    if (!n) return 0;
+    j = malloc(sizeof(te_jit));
+    if (!j) return 0;
+    j->code = te_bytecode_compile(n);
+    j->native = 0;
+    j->page = 0;
+    j->size = 0;
+    if (!j->code) {
+        free(j);
+        return 0;
+    }
+#ifdef TE_JIT
+    jit_native(j);
+#endif
+    return j;
+}
+
+Rational te_jit_eval(const te_jit *j) {
+    if (!j) return RNAN();
+    return j->native ? j->native() : te_bytecode_eval(j->code);
+}
+
+te_native te_jit_function(const te_jit *j) {
+    return j ? j->native : 0;
+}
+
+void te_jit_free(te_jit *j) {
+    if (!j) return;
+#ifdef TE_JIT
+    if (j->page) munmap(j->page, j->size);
+#endif
+    te_bytecode_free(j->code);
+    free(j);
+}
+
+
+/* Incremental evaluation. Each distinct node of the expression keeps its last
+ * value and a dirty flag, and knows its parents. Marking a variable dirties
+ * the paths from its leaves up to the root, stopping where a node is already
+ * dirty; evaluation descends from the root into dirty nodes only and reuses
+ * every clean value. Calls without TE_FLAG_PURE are dirtied before every
+ * evaluation, so they and what depends on them always recompute. */
+
+typedef struct te_inode {
+    te_op op;               /* OP_CONSTANT, OP_VARIABLE, an arithmetic op, or a call. */
+    Rational value;
+    int dirty;
+    int children;           /* Index into links of the first of op.arity children. */
+    int parents, parent_count;
+} te_inode;
+
+struct te_incremental {
+    te_inode *nodes;
+    int *links;
+    int count, root;
+    int *impure, impure_count;
+    const Rational **bound; /* Variable leaves by address, for te_incremental_mark. */
+    int *leaf;
+    unsigned mask;
+};
+
+typedef struct incremental_builder {
+    te_incremental *inc;
+    te_refs refs;
+    int links;
+} incremental_builder;
+
+static int *find_leaf(te_incremental *inc, const Rational *bound) {
+    unsigned h = address_hash(bound) & inc->mask;
+    while (inc->bound[h] && inc->bound[h] != bound) h = (h + 1) & inc->mask;
+    if (!inc->bound[h]) {
+        inc->bound[h] = bound;
+        inc->leaf[h] = -1;
+    }
+    return inc->leaf + h;
+}
+
+/* Appends n's distinct nodes in post-order and returns n's index. */
+static int incremental_node(incremental_builder *b, const te_expr *n) {
+    te_incremental *inc = b->inc;
+    te_ref *ref = find_ref(&b->refs, n);
+    const int arity = ARITY(n->type);
+    int args[7], i, index, *leaf = 0;
+    te_inode *node;
+
+    if (ref->slot >= 0) return ref->slot;
+    if (TYPE_MASK(n->type) == TE_VARIABLE) {
+        /* One leaf per address, however many nodes read it. */
+        leaf = find_leaf(inc, n->bound);
+        if (*leaf >= 0) return ref->slot = *leaf;
+    }
+    for (i = 0; i < arity; ++i) args[i] = incremental_node(b, n->parameters[i]);
+
+    index = ref->slot = inc->count++;
+    node = inc->nodes + index;
+    memset(node, 0, sizeof(*node));
+    node->op.arity = arity;
+    node->dirty = 1;
+    node->children = b->links;
+    for (i = 0; i < arity; ++i) inc->links[b->links++] = args[i];
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: node->op.code = OP_CONSTANT; node->value = n->value; node->dirty = 0; break;
+        case TE_VARIABLE: node->op.code = OP_VARIABLE; node->op.bound = n->bound; *leaf = index; break;
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+            node->op.function = n->function;
+            if (arity == 2 && n->function == add) node->op.code = OP_ADD;
+            else if (arity == 2 && n->function == sub) node->op.code = OP_SUB;
+            else if (arity == 2 && n->function == mul) node->op.code = OP_MUL;
+            else if (arity == 2 && n->function == divide) node->op.code = OP_DIVIDE;
+            else if (arity == 2 && n->function == comma) node->op.code = OP_COMMA;
+            else if (arity == 1 && n->function == negate) node->op.code = OP_NEGATE;
+            else node->op.code = OP_FUNCTION;
+            break;
+
+        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            node->op.code = OP_CLOSURE;
+            node->op.function = n->function;
+            node->op.context = n->parameters[arity];
+            break;
+
+        default:
+            node->op.code = OP_CONSTANT;
+            node->value = RNAN();
+            node->dirty = 0;
+            break;
+    }
+    if (is_call(n) && !IS_PURE(n->type)) inc->impure[inc->impure_count++] = index;
+    return index;
+}
+
+te_incremental *te_incremental_create(const te_expr *n) {
+    incremental_builder b;
+    te_incremental *inc;
+    int size, i, j, links;
+
+    if (!n) return 0;
+    size = tree_count(n);
+    inc = calloc(1, sizeof(te_incremental));
+    b.refs.mask = table_mask(size);
+    b.refs.refs = calloc(b.refs.mask + 1, sizeof(te_ref));
+    b.links = 0;
+    if (inc) {
+        inc->mask = b.refs.mask;
+        inc->nodes = malloc(sizeof(te_inode) * size);
+        inc->links = malloc(sizeof(int) * 2 * size);
+        inc->impure = malloc(sizeof(int) * size);
+        inc->bound = calloc(inc->mask + 1, sizeof(Rational*));
+        inc->leaf = malloc(sizeof(int) * (inc->mask + 1));
+    }
+    if (!inc || !b.refs.refs || !inc->nodes || !inc->links || !inc->impure || !inc->bound || !inc->leaf) {
+        free(b.refs.refs);
+        te_incremental_free(inc);
+        return 0;
+    }
+
+    b.inc = inc;
+    inc->root = incremental_node(&b, n);
+    free(b.refs.refs);
+
+    /* Parents go after the children in links, grouped by node. */
+    links = b.links;
+    for (i = 0; i < inc->count; ++i) {
+        for (j = 0; j < inc->nodes[i].op.arity; ++j) ++inc->nodes[inc->links[inc->nodes[i].children + j]].parent_count;
+    }
+    for (i = 0; i < inc->count; ++i) {
+        inc->nodes[i].parents = links;
+        links += inc->nodes[i].parent_count;
+        inc->nodes[i].parent_count = 0;
+    }
+    for (i = 0; i < inc->count; ++i) {
+        for (j = 0; j < inc->nodes[i].op.arity; ++j) {
+            te_inode *child = inc->nodes + inc->links[inc->nodes[i].children + j];
+            inc->links[child->parents + child->parent_count++] = i;
+        }
+    }
+    return inc;
+}
+
+static void incremental_dirty(te_incremental *inc, int index) {
+    te_inode *node = inc->nodes + index;
+    int i;
+    if (node->dirty) return;
+    node->dirty = 1;
+    for (i = 0; i < node->parent_count; ++i) incremental_dirty(inc, inc->links[node->parents + i]);
+}
+
+void te_incremental_mark(te_incremental *inc, const Rational *bound) {
+    unsigned h;
+    int i;
+    if (!inc) return;
+    if (!bound) {
+        for (i = 0; i < inc->count; ++i) inc->nodes[i].dirty = inc->nodes[i].op.code != OP_CONSTANT;
+        return;
+    }
+    for (h = address_hash(bound) & inc->mask; inc->bound[h]; h = (h + 1) & inc->mask) {
+        if (inc->bound[h] == bound) {
+            incremental_dirty(inc, inc->leaf[h]);
+            return;
+        }
+    }
+}
+
+/* Brings a node up to date; clean subtrees are not visited. */
+static Rational incremental_refresh(te_incremental *inc, int index) {
+    te_inode *node = inc->nodes + index;
+    Rational args[7];
+    int i;
+
+    if (!node->dirty) return node->value;
+    for (i = 0; i < node->op.arity; ++i) args[i] = incremental_refresh(inc, inc->links[node->children + i]);
+
+    switch (node->op.code) {
+        case OP_VARIABLE: node->value = *node->op.bound; break;
+        case OP_ADD: node->value = add(args[0], args[1]); break;
+        case OP_SUB: node->value = sub(args[0], args[1]); break;
+        case OP_MUL: node->value = mul(args[0], args[1]); break;
+        case OP_DIVIDE: node->value = divide(args[0], args[1]); break;
+        case OP_COMMA: node->value = args[1]; break;
+        case OP_NEGATE: node->value = negate(args[0]); break;
+        case OP_FUNCTION: case OP_CLOSURE: node->value = call_op(&node->op, args); break;
+    }
+    node->dirty = 0;
+    return node->value;
+}
+
+Rational te_incremental_eval(te_incremental *inc) {
+    int i;
+    if (!inc) return RNAN();
+    for (i = 0; i < inc->impure_count; ++i) incremental_dirty(inc, inc->impure[i]);
+    return incremental_refresh(inc, inc->root);
+}
+
+void te_incremental_free(te_incremental *inc) {
+    if (!inc) return;
+    free(inc->nodes);
+    free(inc->links);
+    free(inc->impure);
+    free(inc->bound);
+    free(inc->leaf);
+    free(inc);
+}
+
+
+/* Programs: named formulas compiled together. A formula may use another's
+ * name as a variable. Formulas are packed in dependency order into one
+ * hash-consed block, where a reference to a formula becomes its packed root,
+ * so subterms common to any of them are one node. The block is lowered once,
+ * with every formula's root kept in a slot; one run fills all the outputs. */
+
+typedef struct te_output {
+    int slot;                   /* Slot holding the value, or -1 for a leaf: */
+    const Rational *bound;      /* a variable, */
+    Rational value;             /* or a constant. */
+} te_output;
+
+struct te_program {
+    te_bytecode *code;
+    int count;
+    te_output outputs[1];
+};
+
+typedef struct program_builder {
+    const te_formula *formulas;
+    int count;
+    const te_symbols *symbols;
+    const te_variable *names;   /* The formulas as variables, bound to results. */
+    int *state;                 /* 0 unvisited, 1 visiting, 2 placed */
+    int *order, placed;
+} program_builder;
+
+/* Places formula i after the formulas it names. Returns the index of a
+ * formula found on a cycle, or -1. */
+static int program_order(program_builder *b, int i) {
+    const char *p = b->formulas[i].expression;
+    int cycle;
+
+    b->state[i] = 1;
+    while (*p) {
+        if ((*p >= '0' && *p <= '9') || *p == '.') {
+            /* Skipped as the tokenizer reads it, so exponents are not names. */
+            unsigned long long digits;
+            int exponent;
+            if (!scan_number(p, &p, &digits, &exponent)) ++p;
+        } else if (isalpha(*p)) {
+            const char *start = p;
+            const te_variable *var;
+            while (isalpha(*p) || isdigit(*p) || *p == '_') ++p;
+            var = find_symbol(b->symbols, start, p - start);
+            if (var >= b->names && var < b->names + b->count) {
+                const int j = var - b->names;
+                if (b->state[j] == 1) return j;
+                if (b->state[j] == 0 && (cycle = program_order(b, j)) >= 0) return cycle;
+            }
+        } else {
+            ++p;
+        }
+    }
+    b->state[i] = 2;
+    b->order[b->placed++] = i;
+    return -1;
+}
+
+te_program *te_program_compile(const te_formula *formulas, int count, const te_variable *variables, int var_count,
+        int *failed, int *error) {
+    te_program *prog = 0;
+    te_variable *all = 0;
+    te_symbols *sym = 0;
+    te_expr **trees = 0, **roots = 0, *chain = 0;
+    Rational *results = 0;
+    program_builder b;
+    te_dag dag;
+    size_t size = 0;
+    char *block = 0, *cursor;
+    int i, nodes = 0, bad = -1, position = 0, *slots = 0;
+
+    memset(&b, 0, sizeof(b));
+    dag.slots = 0;
+    if (count <= 0) goto done;
+
+    all = malloc(sizeof(te_variable) * (var_count + count));
+    results = malloc(sizeof(Rational) * count);
+    trees = calloc(count, sizeof(te_expr*));
+    roots = calloc(count, sizeof(te_expr*));
+    slots = malloc(sizeof(int) * count);
+    b.state = calloc(count, sizeof(int));
+    b.order = malloc(sizeof(int) * count);
+    if (!all || !results || !trees || !roots || !slots || !b.state || !b.order) goto done;
+
+    /* Formula names resolve to their slot in results, which is never read:
+     * packing swaps each such variable for the formula itself. */
+    memcpy(all, variables, sizeof(te_variable) * var_count);
+    for (i = 0; i < count; ++i) {
+        all[var_count + i].name = formulas[i].name;
+        all[var_count + i].address = results + i;
+        all[var_count + i].type = TE_VARIABLE;
+        all[var_count + i].context = 0;
+    }
+    sym = te_symbols_create(all, var_count + count);
+    if (!sym) goto done;
+
+    /* Every name must mean one thing. */
+    for (i = 0; i < count; ++i) {
+        const te_variable *var = find_symbol(sym, formulas[i].name, strlen(formulas[i].name));
+        if (var != all + var_count + i) {
+            bad = i;
+            position = -1;
+            goto done;
+        }
+    }
+
+    b.formulas = formulas;
+    b.count = count;
+    b.symbols = sym;
+    b.names = all + var_count;
+    for (i = 0; i < count; ++i) {
+        if (b.state[i] == 0 && (bad = program_order(&b, i)) >= 0) {
+            position = -1;
+            goto done;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        trees[i] = te_compile_symbols(formulas[i].expression, sym, &position);
+        if (!trees[i]) {
+            bad = i;
+            goto done;
+        }
+        size += tree_size(trees[i], &nodes);
+    }
+
+    /* Formulas pack in dependency order so references find their target
+     * packed already. The outputs are chained with commas into one root. */
+    size += node_size(TE_FUNCTION2) * (count - 1);
+    block = malloc(size ? size : 1);
+    dag.mask = table_mask(nodes);
+    dag.slots = calloc(dag.mask + 1, sizeof(te_expr*));
+    dag.results = results;
+    dag.roots = roots;
+    dag.count = count;
+    if (!block || !dag.slots) goto done;
+    cursor = block;
+    for (i = 0; i < count; ++i) {
+        const int k = b.order[i];
+        roots[k] = pack_tree(trees[k], &cursor, &dag, 0);
+    }
+    chain = roots[0];
+    for (i = 1; i < count; ++i) {
+        te_expr *link = (te_expr*)cursor;
+        cursor += node_size(TE_FUNCTION2);
+        link->type = TE_FUNCTION2 | TE_FLAG_PURE;
+        link->function = comma;
+        link->parameters[0] = chain;
+        link->parameters[1] = roots[i];
+        chain = link;
+    }
+
+    prog = malloc(sizeof(te_program) + sizeof(te_output) * (count - 1));
+    if (!prog) goto done;
+    prog->count = count;
+    /* Counted as a tree the chain can be exponential in its DAG; the packed
+     * nodes plus the comma links bound it. */
+    prog->code = bytecode_compile(chain, nodes + count - 1, roots, count, slots);
+    if (!prog->code) {
+        free(prog);
+        prog = 0;
+        goto done;
+    }
+    for (i = 0; i < count; ++i) {
+        te_output *o = prog->outputs + i;
+        o->slot = slots[i];
+        o->bound = TYPE_MASK(roots[i]->type) == TE_VARIABLE ? roots[i]->bound : 0;
+        o->value = TYPE_MASK(roots[i]->type) == TE_CONSTANT ? roots[i]->value : RNAN();
+    }
+
+done:
+    if (failed) *failed = bad;
+    if (error) *error = bad >= 0 ? position : 0;
+    for (i = 0; trees && i < count; ++i) te_free(trees[i]);
+    te_symbols_free(sym);
+    free(dag.slots);
+    free(block);
+    free(all);
+    free(results);
+    free(trees);
+    free(roots);
+    free(slots);
+    free(b.state);
+    free(b.order);
+    return prog;
+}
+
+int te_program_count(const te_program *prog) {
+    return prog ? prog->count : 0;
+}
+
+int te_program_eval(const te_program *prog, Rational *out) {
+    Rational local[TE_STACK_SIZE];
+    Rational *stack, *slots;
+    int i;
+
+    if (!prog) return -1;
+    stack = prog->code->depth + prog->code->slots <= TE_STACK_SIZE ? local
+            : malloc(sizeof(Rational) * (prog->code->depth + prog->code->slots));
+    if (!stack) return -1;
+    bytecode_run(prog->code, stack);
+    slots = stack + prog->code->depth;
+    for (i = 0; i < prog->count; ++i) {
+        const te_output *o = prog->outputs + i;
+        out[i] = o->slot >= 0 ? slots[o->slot] : o->bound ? *o->bound : o->value;
+    }
+    if (stack != local) free(stack);
+    return 0;
+}
+
+void te_program_free(te_program *prog) {
+    if (!prog) return;
+    te_bytecode_free(prog->code);
+    free(prog);
+}
+
+
+/* Images: lowered instructions in a self-contained, position-independent
+ * block that can be written to a file and evaluated where it is mapped.
+ * Variables become indices into the variable array instead of pointers, and
+ * functions entries of a table that te_image_open resolves, by name for
+ * builtins and by index for the caller's functions and closures. Only that
+ * small table is private to a process; the instructions are shared pages.
+ *
+ * Layout, in native byte order and 8-byte aligned:
+ *   te_image_header
+ *   long long offsets[count]           each record, from the start
+ *   te_image_function functions[]      names are offsets of NUL-terminated strings
+ *   records: te_image_record, then te_image_op ops[record.count]
+ *   strings
+ * The OP_ numbering is part of the format; changing it needs a new version. */
+
+#define TE_IMAGE_VERSION 1
+
+typedef struct te_image_header {
+    char magic[4];              /* "TEXB" */
+    unsigned order;             /* 0x01020304 as written, to reject the other byte order. */
+    unsigned version;
+    int count;                  /* Expressions. */
+    int var_count;              /* Entries the values array needs. */
+    int function_count;
+    long long functions;        /* Offset of the function table. */
+    long long size;             /* Of the whole image. */
+} te_image_header;
+
+typedef struct te_image_function {
+    int type;
+    int variable;               /* Index into the variables, or -1 for a builtin. */
+    long long name;
+} te_image_function;
+
+typedef struct te_image_record {
+    int count;
+    int depth;
+    int slots;
+    int reserved;
+} te_image_record;
+
+typedef struct te_image_op {
+    int code;
+    int arg;                    /* Variable index, slot, or function table index. */
+    Rational value;
+} te_image_op;
+
+struct te_image {
+    const unsigned char *data;
+    size_t size;
+    void *mapping;              /* What te_image_close releases, if anything. */
+    size_t mapping_size;
+    int count;
+    int var_count;
+    te_op *calls;               /* The function table, resolved for this process. */
+};
+
+/* Functions the parser calls that are not builtins by name. */
+static const te_variable internals[] = {
+    {"$tenpow", tenpow, TE_FUNCTION2 | TE_FLAG_PURE, 0},
+    {"$fmod", rmod, TE_FUNCTION2 | TE_FLAG_PURE, 0},
+    {0, 0, 0, 0}
+};
+
+typedef struct image_writer {
+    unsigned char *data;
+    size_t size, capacity;
+    const te_variable *variables;
+    int var_count;
+    const te_variable **bound;  /* Variables hashed by address. */
+    unsigned mask;
+    te_image_function *functions;
+    const te_variable **sources;    /* What each function entry refers to. */
+    int function_count, function_capacity;
+    int failed;
+} image_writer;
+
+static void *image_reserve(image_writer *w, size_t size) {
+    void *at;
+    if (w->size + size > w->capacity) {
+        size_t capacity = w->capacity ? w->capacity : 4096;
+        unsigned char *data;
+        while (capacity < w->size + size) capacity *= 2;
+        data = realloc(w->data, capacity);
+        if (!data) {
+            w->failed = 1;
+            return 0;
+        }
+        w->data = data;
+        w->capacity = capacity;
+    }
+    at = w->data + w->size;
+    memset(at, 0, size);
+    w->size += (size + 7) & ~(size_t)7;
+    return at;
+}
+
+static int image_variable(const image_writer *w, const Rational *bound) {
+    unsigned h = address_hash(bound) & w->mask;
+    for (; w->bound[h]; h = (h + 1) & w->mask) {
+        if (w->bound[h]->address == bound) return (int)(w->bound[h] - w->variables);
+    }
+    return -1;
+}
+
+static const te_variable *find_function(const te_variable *table, int count, const te_op *op, int type) {
+    int i;
+    for (i = 0; i < count && table[i].name; ++i) {
+        if (table[i].address == op->function && (table[i].type & ~TE_FLAG_PURE) == (type & ~TE_FLAG_PURE)
+                && (op->code != OP_CLOSURE || table[i].context == op->context)) return table + i;
+    }
+    return 0;
+}
+
+/* Returns the table entry for a call, adding it on first use, or -1. */
+static int image_function(image_writer *w, const te_op *op) {
+    const int type = (op->code == OP_CLOSURE ? TE_CLOSURE0 : TE_FUNCTION0) | op->arity;
+    const te_variable *var;
+    int i;
+
+    for (i = 0; i < w->function_count; ++i) {
+        var = w->sources[i];
+        if (var->address == op->function && (var->type & ~TE_FLAG_PURE) == type
+                && (op->code != OP_CLOSURE || var->context == op->context)) return i;
+    }
+
+    var = find_function(w->variables, w->var_count, op, type);
+    if (!var && op->code == OP_FUNCTION) var = find_function(functions, INT_MAX, op, type);
+    if (!var && op->code == OP_FUNCTION) var = find_function(internals, INT_MAX, op, type);
+    if (!var) return -1;
+
+    if (w->function_count == w->function_capacity) {
+        const int capacity = w->function_capacity ? w->function_capacity * 2 : 16;
+        te_image_function *f = realloc(w->functions, sizeof(te_image_function) * capacity);
+        const te_variable **s = f ? realloc(w->sources, sizeof(te_variable*) * capacity) : 0;
+        if (f) w->functions = f;
+        if (!s) return -1;
+        w->sources = s;
+        w->function_capacity = capacity;
+    }
+    w->functions[w->function_count].type = type;
+    w->functions[w->function_count].variable = var >= w->variables && var < w->variables + w->var_count ? (int)(var - w->variables) : -1;
+    w->sources[w->function_count] = var;
+    return w->function_count++;
+}
+
+static void image_expression(image_writer *w, const te_expr *n) {
+    te_bytecode *b = te_bytecode_compile(n);
+    te_image_record *rec;
+    te_image_op *ops;
+    int i;
+
+    if (!b) {
+        w->failed = 1;
+        return;
+    }
+    rec = image_reserve(w, sizeof(te_image_record) + sizeof(te_image_op) * b->count);
+    if (rec) {
+        rec->count = b->count;
+        rec->depth = b->depth;
+        rec->slots = b->slots;
+        ops = (te_image_op*)(rec + 1);
+        for (i = 0; i < b->count; ++i) {
+            const te_op *op = b->ops + i;
+            ops[i].code = op->code;
+            switch (op->code) {
+                case OP_CONSTANT: ops[i].value = op->value; break;
+                case OP_VARIABLE: ops[i].arg = image_variable(w, op->bound); break;
+                case OP_STORE: case OP_LOAD: ops[i].arg = op->slot; break;
+                case OP_FUNCTION: case OP_CLOSURE: ops[i].arg = image_function(w, op); break;
+            }
+            if (ops[i].arg < 0) w->failed = 1;
+        }
+    }
+    te_bytecode_free(b);
+}
+
+void *te_image_save(const te_expr *const *expressions, int count, const te_variable *variables, int var_count, size_t *size) {
+    image_writer w;
+    te_image_header *header;
+    size_t offsets, table;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    w.variables = variables;
+    w.var_count = var_count;
+    w.mask = table_mask(var_count);
+    w.bound = calloc(w.mask + 1, sizeof(te_variable*));
+    if (!w.bound || count < 0) {
+        free(w.bound);
+        return 0;
+    }
+    for (i = 0; i < var_count; ++i) {
+        unsigned h = address_hash(variables[i].address) & w.mask;
+        if (TYPE_MASK(variables[i].type) != TE_VARIABLE) continue;
+        while (w.bound[h] && w.bound[h]->address != variables[i].address) h = (h + 1) & w.mask;
+        if (!w.bound[h]) w.bound[h] = variables + i;
+    }
+
+    image_reserve(&w, sizeof(te_image_header));
+    offsets = w.size;
+    image_reserve(&w, sizeof(long long) * (count ? count : 1));
+    for (i = 0; i < count && !w.failed; ++i) {
+        const long long at = (long long)w.size;
+        image_expression(&w, expressions[i]);
+        if (!w.failed) memcpy(w.data + offsets + sizeof(long long) * i, &at, sizeof(at));
+    }
+
+    /* The function table goes last, once every call has been seen. */
+    table = w.size;
+    image_reserve(&w, sizeof(te_image_function) * (w.function_count ? w.function_count : 1));
+    for (i = 0; i < w.function_count && !w.failed; ++i) {
+        const size_t len = strlen(w.sources[i]->name) + 1;
+        char *name = image_reserve(&w, len);
+        if (!name) break;
+        memcpy(name, w.sources[i]->name, len);
+        w.functions[i].name = (long long)(name - (char*)w.data);
+    }
+    if (!w.failed) {
+        memcpy(w.data + table, w.functions, sizeof(te_image_function) * w.function_count);
+        header = (te_image_header*)w.data;
+        memcpy(header->magic, "TEXB", 4);
+        header->order = 0x01020304;
+        header->version = TE_IMAGE_VERSION;
+        header->count = count;
+        header->var_count = var_count;
+        header->function_count = w.function_count;
+        header->functions = (long long)table;
+        header->size = (long long)w.size;
+        *size = w.size;
+    }
+
+    free(w.bound);
+    free(w.functions);
+    free(w.sources);
+    if (w.failed) {
+        free(w.data);
+        return 0;
+    }
+    return w.data;
+}
+
+/* Checks that the record at offset is in bounds and that its instructions
+ * keep to their stack, slots, variables and functions, so evaluation need
+ * not check anything. Slots are numbered in the order they are first
+ * stored, so stored counts those written so far and a load must be below it. */
+static int image_record_valid(const te_image *img, long long offset, int function_count) {
+    const te_image_record *rec;
+    const te_image_op *ops;
+    int i, sp = 0, stored = 0;
+
+    if (offset < (long long)sizeof(te_image_header) || offset % 8 || (size_t)offset + sizeof(te_image_record) > img->size) return 0;
+    rec = (const te_image_record*)(img->data + offset);
+    if (rec->count < 1 || rec->depth < 1 || rec->depth > rec->count || rec->slots < 0 || rec->slots > rec->count
+            || (size_t)rec->count > (img->size - offset - sizeof(te_image_record)) / sizeof(te_image_op)) return 0;
+    ops = (const te_image_op*)(rec + 1);
+
+    for (i = 0; i < rec->count; ++i) {
+        switch (ops[i].code) {
+            case OP_CONSTANT: ++sp; break;
+            case OP_VARIABLE: if (ops[i].arg < 0 || ops[i].arg >= img->var_count) return 0; ++sp; break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIVIDE: case OP_COMMA: if (sp < 2) return 0; --sp; break;
+            case OP_NEGATE: if (sp < 1) return 0; break;
+            case OP_STORE:
+                if (sp < 1 || ops[i].arg < 0 || ops[i].arg > stored || ops[i].arg >= rec->slots) return 0;
+                if (ops[i].arg == stored) ++stored;
+                break;
+            case OP_LOAD: if (ops[i].arg < 0 || ops[i].arg >= stored) return 0; ++sp; break;
+            case OP_FUNCTION: case OP_CLOSURE:
+                if (ops[i].arg < 0 || ops[i].arg >= function_count || img->calls[ops[i].arg].code != ops[i].code) return 0;
+                sp -= img->calls[ops[i].arg].arity - 1;
+                if (sp < 1) return 0;
+                break;
+            default: return 0;
+        }
+        if (sp > rec->depth) return 0;
+    }
+    return sp == 1;
+}
+
+static int image_resolve(const te_image *img, const te_image_function *f, te_op *call, const te_variable *variables, int var_count) {
+    const te_variable *var = 0;
+    const char *name;
+    long long i;
+
+    if (f->name < 0 || (size_t)f->name >= img->size) return 0;
+    name = (const char*)img->data + f->name;
+    for (i = f->name; i < (long long)img->size && img->data[i]; ++i);
+    if (i == (long long)img->size) return 0;
+
+    if (f->variable >= 0) {
+        if (f->variable < var_count && strcmp(variables[f->variable].name, name) == 0) var = variables + f->variable;
+    } else {
+        var = find_builtin(name, strlen(name));
+        for (i = 0; !var && internals[i].name; ++i) {
+            if (strcmp(internals[i].name, name) == 0) var = internals + i;
+        }
+    }
+    if (!var || (var->type & ~TE_FLAG_PURE) != (f->type & ~TE_FLAG_PURE)) return 0;
+
+    call->code = IS_CLOSURE(f->type) ? OP_CLOSURE : OP_FUNCTION;
+    call->arity = ARITY(f->type);
+    call->pure = IS_PURE(var->type);
+    call->function = var->address;
+    call->context = var->context;
+    return 1;
+}
+
+static te_image *image_open(const void *data, size_t size, const te_variable *variables, int var_count) {
+    const te_image_header *header = data;
+    const te_image_function *table;
+    te_image *img;
+    int i;
+
+    if (size < sizeof(te_image_header) || (size_t)data % 8) return 0;
+    if (memcmp(header->magic, "TEXB", 4) != 0 || header->order != 0x01020304 || header->version != TE_IMAGE_VERSION) return 0;
+    if (header->size < 0 || (size_t)header->size > size || header->count < 0 || header->var_count < 0 || header->function_count < 0) return 0;
+    size = (size_t)header->size;
+    if ((size - sizeof(te_image_header)) / sizeof(long long) < (size_t)header->count) return 0;
+    if (header->functions < 0 || header->functions % 8
+            || (size_t)header->functions > size || (size - header->functions) / sizeof(te_image_function) < (size_t)header->function_count) return 0;
+
+    img = malloc(sizeof(te_image) + sizeof(te_op) * header->function_count);
+    if (!img) return 0;
+    img->data = data;
+    img->size = size;
+    img->mapping = 0;
+    img->mapping_size = 0;
+    img->count = header->count;
+    img->var_count = header->var_count;
+    img->calls = (te_op*)(img + 1);
+
+    table = (const te_image_function*)((const unsigned char*)data + header->functions);
+    for (i = 0; i < header->function_count; ++i) {
+        if (!image_resolve(img, table + i, img->calls + i, variables, var_count)) {
+            free(img);
+            return 0;
+        }
+    }
+    for (i = 0; i < img->count; ++i) {
+        long long offset;
+        memcpy(&offset, img->data + sizeof(te_image_header) + sizeof(long long) * i, sizeof(offset));
+        if (!image_record_valid(img, offset, header->function_count)) {
+            free(img);
+            return 0;
+        }
+    }
+    return img;
+}
+
+te_image *te_image_open(const void *data, size_t size, const te_variable *variables, int var_count) {
+    return data ? image_open(data, size, variables, var_count) : 0;
+}
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(TE_NO_MMAP)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+te_image *te_image_map(const char *path, const te_variable *variables, int var_count) {
+    struct stat st;
+    te_image *img = 0;
+    void *data;
+    const int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            img = image_open(data, (size_t)st.st_size, variables, var_count);
+            if (img) {
+                img->mapping = data;
+                img->mapping_size = (size_t)st.st_size;
+            } else {
+                munmap(data, (size_t)st.st_size);
+            }
+        }
+    }
+    close(fd);
+    return img;
+}
+#else
+/* Without mmap the file is read into one private block. */
+te_image *te_image_map(const char *path, const te_variable *variables, int var_count) {
+    te_image *img = 0;
+    void *data = 0;
+    long size;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) return 0;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0
+            && (data = malloc((size_t)size)) != 0 && fread(data, 1, (size_t)size, f) == (size_t)size) {
+        img = image_open(data, (size_t)size, variables, var_count);
+    }
+    fclose(f);
+    if (img) img->mapping = data;
+    else free(data);
+    return img;
+}
+#endif
+
+int te_image_count(const te_image *img) {
+    return img ? img->count : 0;
+}
+
+Rational te_image_eval(const te_image *img, int index, const Rational *values) {
+    Rational local[TE_STACK_SIZE];
+    Rational *stack, *sp, *slots;
+    const te_image_record *rec;
+    const te_image_op *op, *end;
+    long long offset;
+    Rational ret;
+
+    if (!img || index < 0 || index >= img->count) return RNAN();
+    memcpy(&offset, img->data + sizeof(te_image_header) + sizeof(long long) * index, sizeof(offset));
+    rec = (const te_image_record*)(img->data + offset);
+
+    stack = rec->depth + rec->slots <= TE_STACK_SIZE ? local : malloc(sizeof(Rational) * (rec->depth + rec->slots));
+    if (!stack) return RNAN();
+    slots = stack + rec->depth;
+    sp = stack - 1;
+
+    for (op = (const te_image_op*)(rec + 1), end = op + rec->count; op != end; ++op) {
+        switch (op->code) {
+            case OP_CONSTANT: *++sp = op->value; break;
+            case OP_VARIABLE: *++sp = values[op->arg]; break;
+            case OP_ADD: --sp; sp[0] = add(sp[0], sp[1]); break;
+            case OP_SUB: --sp; sp[0] = sub(sp[0], sp[1]); break;
+            case OP_MUL: --sp; sp[0] = mul(sp[0], sp[1]); break;
+            case OP_DIVIDE: --sp; sp[0] = divide(sp[0], sp[1]); break;
+            case OP_COMMA: --sp; sp[0] = sp[1]; break;
+            case OP_NEGATE: sp[0] = negate(sp[0]); break;
+            case OP_STORE: slots[op->arg] = sp[0]; break;
+            case OP_LOAD: *++sp = slots[op->arg]; break;
+
+            case OP_FUNCTION:
+            case OP_CLOSURE: {
+                const te_op *call = img->calls + op->arg;
+                sp -= call->arity - 1;
+                sp[0] = call_op(call, sp);
+                break;
+            }
+        }
+    }
+
+    ret = sp[0];
+    if (stack != local) free(stack);
+    return ret;
+}
+
+void te_image_close(te_image *img) {
+    if (!img) return;
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(TE_NO_MMAP)
+    if (img->mapping) munmap(img->mapping, img->mapping_size);
+#else
+    free(img->mapping);
+#endif
+    free(img);
+}
+
+
+/* Batch evaluation runs each instruction across a block of rows before moving
+ * to the next one, so the instruction walk is paid once per block. */
+
+#define TE_BLOCK 64
+
+typedef struct te_lanes {
+    long long num[TE_BLOCK];
+    long long den[TE_BLOCK];
+} te_lanes;
+
+static void fill_lanes(te_lanes *l, Rational value, int len) {
+    int i;
+    for (i = 0; i < len; ++i) {
+        l->num[i] = value.numerator;
+        l->den[i] = value.denominator;
+    }
+}
+
+/* Vector kernels for the batch operators. A group of four lanes takes the
+ * vector path when every operand fits in 32 bits, so the cross products fit
+ * in 63 bits and match the scalar result exactly; anything else goes through
+ * the scalar add/sub/mul/divide. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TE_AVX2 __attribute__((target("avx2")))
+static int has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define TE_AVX2
+static int has_avx2(void) {
+    static int cached = -1;
+    if (cached < 0) {
+        int info[4];
+        int ok = 0;
+        __cpuid(info, 1);
+        /* The OS must save the YMM registers (OSXSAVE + XCR0 bits 1 and 2). */
+        if ((info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) {
+            __cpuidex(info, 7, 0);
+            ok = (info[1] & (1 << 5)) != 0;
+        }
+        cached = ok;
+    }
+    return cached;
+}
+#endif
+
+#ifdef TE_AVX2
+TE_AVX2 static __m256i abs_epi64(__m256i x) {
+    const __m256i sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), x);
+    return _mm256_sub_epi64(_mm256_xor_si256(x, sign), sign);
+}
+
+/* Lanes set where |x| < 2^31. */
+TE_AVX2 static __m256i fits32(__m256i x) {
+    const __m256i hi = _mm256_set1_epi64x(0x7FFFFFFFLL);
+    const __m256i lo = _mm256_set1_epi64x(-0x80000000LL);
+    return _mm256_andnot_si256(_mm256_cmpgt_epi64(x, hi), _mm256_cmpgt_epi64(x, lo));
+}
+
+/* Trailing zero count per lane, as popcount((x & -x) - 1); zero lanes give 64. */
+TE_AVX2 static __m256i ctz_epi64(__m256i x) {
+    const __m256i nibbles = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i m = _mm256_sub_epi64(_mm256_and_si256(x, _mm256_sub_epi64(zero, x)), _mm256_set1_epi64x(1));
+    const __m256i lo = _mm256_shuffle_epi8(nibbles, _mm256_and_si256(m, low4));
+    const __m256i hi = _mm256_shuffle_epi8(nibbles, _mm256_and_si256(_mm256_srli_epi64(m, 4), low4));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero);
+}
+
+/* Binary GCD of u > 0 and v >= 0, four lanes at a time. */
+TE_AVX2 static __m256i gcd_epi64(__m256i u, __m256i v) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i shift = ctz_epi64(_mm256_or_si256(u, v));
+    __m256i done;
+
+    u = _mm256_srlv_epi64(u, ctz_epi64(u));
+    for (;;) {
+        __m256i lo;
+        done = _mm256_cmpeq_epi64(v, zero);
+        if (_mm256_movemask_epi8(done) == -1) break;
+        /* Shifting a zero lane by 64 leaves it zero, so finished lanes stay put. */
+        v = _mm256_srlv_epi64(v, ctz_epi64(v));
+        lo = _mm256_blendv_epi8(u, v, _mm256_cmpgt_epi64(u, v));
+        v = _mm256_blendv_epi8(abs_epi64(_mm256_sub_epi64(u, v)), zero, done);
+        u = _mm256_blendv_epi8(lo, u, done);
+    }
+
+    return _mm256_sllv_epi64(u, shift);
+}
+
+/* Computes four lanes starting at i. Returns 0 when they need the scalar path. */
+TE_AVX2 static int avx2_lanes(int code, te_lanes *a, const te_lanes *b, int i) {
+    const __m256i an = _mm256_loadu_si256((const __m256i*)(a->num + i));
+    const __m256i ad = _mm256_loadu_si256((const __m256i*)(a->den + i));
+    const __m256i bn = _mm256_loadu_si256((const __m256i*)(b->num + i));
+    const __m256i bd = _mm256_loadu_si256((const __m256i*)(b->den + i));
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i ok, num, den, sign, g;
+    long long n[4], d[4], r[4];
+    int j;
+
+    ok = _mm256_and_si256(_mm256_and_si256(fits32(an), fits32(ad)), _mm256_and_si256(fits32(bn), fits32(bd)));
+    if (_mm256_movemask_epi8(ok) != -1) return 0;
+
+    /* _mm256_mul_epi32 multiplies the sign-extended low halves of each lane. */
+    switch (code) {
+        case OP_ADD:
+            num = _mm256_add_epi64(_mm256_mul_epi32(an, bd), _mm256_mul_epi32(bn, ad));
+            den = _mm256_mul_epi32(ad, bd);
+            break;
+        case OP_SUB:
+            num = _mm256_sub_epi64(_mm256_mul_epi32(an, bd), _mm256_mul_epi32(bn, ad));
+            den = _mm256_mul_epi32(ad, bd);
+            break;
+        case OP_MUL:
+            num = _mm256_mul_epi32(an, bn);
+            den = _mm256_mul_epi32(ad, bd);
+            break;
+        default:
+            num = _mm256_mul_epi32(an, bd);
+            den = _mm256_mul_epi32(ad, bn);
+            break;
+    }
+
+    if (!_mm256_testz_si256(_mm256_cmpeq_epi64(den, zero), _mm256_set1_epi64x(-1))) return 0;
+    sign = _mm256_cmpgt_epi64(zero, den);
+    num = _mm256_sub_epi64(_mm256_xor_si256(num, sign), sign);
+    den = _mm256_sub_epi64(_mm256_xor_si256(den, sign), sign);
+
+    /* Integer results need no reduction. */
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(den, _mm256_set1_epi64x(1))) == -1) {
+        _mm256_storeu_si256((__m256i*)(a->num + i), num);
+        _mm256_storeu_si256((__m256i*)(a->den + i), den);
+        return 1;
+    }
+
+    g = gcd_epi64(den, abs_epi64(num));
+
+    /* There is no vector integer divide; the quotients are exact, so do them per lane. */
+    _mm256_storeu_si256((__m256i*)n, num);
+    _mm256_storeu_si256((__m256i*)d, den);
+    _mm256_storeu_si256((__m256i*)r, g);
+    for (j = 0; j < 4; ++j) {
+        a->num[i + j] = n[j] / r[j];
+        a->den[i + j] = d[j] / r[j];
+    }
+    return 1;
+}
+#endif
+
+
+/* Applies OP_ADD, OP_SUB, OP_MUL or OP_DIVIDE lane by lane, storing into a. */
+static void arith_lanes(int code, te_lanes *a, const te_lanes *b, int len) {
+    Rational (*f)(Rational, Rational) = code == OP_ADD ? add : code == OP_SUB ? sub : code == OP_MUL ? mul : divide;
+    int i = 0, j;
+#ifdef TE_AVX2
+    const int simd = has_avx2();
+#endif
+
+    while (i < len) {
+#ifdef TE_AVX2
+        if (simd && len - i >= 4 && avx2_lanes(code, a, b, i)) {
+            i += 4;
+            continue;
+        }
+#endif
+        for (j = i + 4 < len ? i + 4 : len; i < j; ++i) {
+            Rational x, y, r;
+            x.numerator = a->num[i]; x.denominator = a->den[i];
+            y.numerator = b->num[i]; y.denominator = b->den[i];
+            r = f(x, y);
+            a->num[i] = r.numerator;
+            a->den[i] = r.denominator;
+        }
+    }
+}
+
+
+int te_eval_batch(const te_expr *n, const te_variable *variables, const te_column *columns, int var_count,
+        int rows, long long *out_numerator, long long *out_denominator) {
+    te_bytecode *b;
+    int *slot;
+    te_lanes *stack, *sp;
+    int row, i, j;
+
+    if (!n || rows <= 0) return rows < 0 ? -1 : 0;
+
+    b = te_bytecode_compile(n);
+    slot = b ? malloc(sizeof(int) * b->count) : 0;
+    stack = b ? malloc(sizeof(te_lanes) * (b->depth + b->slots)) : 0;
+    if (!b || !slot || !stack) {
+        te_bytecode_free(b);
+        free(slot);
+        free(stack);
+        return -1;
+    }
+
+    /* Resolve each variable instruction to its column once; -1 keeps the bound address. */
+    for (i = 0; i < b->count; ++i) {
+        slot[i] = -1;
+        if (b->ops[i].code != OP_VARIABLE) continue;
+        for (j = 0; j < var_count; ++j) {
+            if (variables[j].address == b->ops[i].bound && columns[j].numerator) {
+                slot[i] = j;
+                break;
+            }
+        }
+    }
+
+    for (row = 0; row < rows; row += TE_BLOCK) {
+        const int len = rows - row < TE_BLOCK ? rows - row : TE_BLOCK;
+        sp = stack - 1;
+
+        for (i = 0; i < b->count; ++i) {
+            const te_op *op = b->ops + i;
+            switch (op->code) {
+                case OP_CONSTANT: fill_lanes(++sp, op->value, len); break;
+
+                case OP_VARIABLE:
+                    ++sp;
+                    if (slot[i] < 0) {
+                        fill_lanes(sp, *op->bound, len);
+                    } else {
+                        const te_column *c = columns + slot[i];
+                        memcpy(sp->num, c->numerator + row, sizeof(long long) * len);
+                        if (c->denominator) {
+                            /* Caller data need not be in lowest terms. */
+                            for (j = 0; j < len; ++j) {
+                                const long long d = c->denominator[row + j];
+                                if (d != 1) {
+                                    const Rational r = reduce(sp->num[j], d);
+                                    sp->num[j] = r.numerator;
+                                    sp->den[j] = r.denominator;
+                                } else {
+                                    sp->den[j] = 1;
+                                }
+                            }
+                        } else {
+                            for (j = 0; j < len; ++j) sp->den[j] = 1;
+                        }
+                    }
+                    break;
+
+                case OP_ADD: --sp; arith_lanes(OP_ADD, sp, sp + 1, len); break;
+                case OP_SUB: --sp; arith_lanes(OP_SUB, sp, sp + 1, len); break;
+                case OP_MUL: --sp; arith_lanes(OP_MUL, sp, sp + 1, len); break;
+                case OP_DIVIDE: --sp; arith_lanes(OP_DIVIDE, sp, sp + 1, len); break;
+                case OP_COMMA: --sp; memcpy(sp, sp + 1, sizeof(te_lanes)); break;
+                case OP_NEGATE:
+                    /* As negate(): -LLONG_MIN does not fit. */
+                    for (j = 0; j < len; ++j) {
+                        const int fits = sp->num[j] != LLONG_MIN;
+                        sp->num[j] = fits ? -sp->num[j] : 0;
+                        sp->den[j] = fits ? sp->den[j] : 0;
+                    }
+                    break;
+                case OP_STORE: memcpy(stack + b->depth + op->slot, sp, sizeof(te_lanes)); break;
+                case OP_LOAD: memcpy(++sp, stack + b->depth + op->slot, sizeof(te_lanes)); break;
+
+                case OP_FUNCTION:
+                case OP_CLOSURE:
+                    sp -= op->arity - 1;
+                    for (j = 0; j < len; ++j) {
+                        Rational args[7], r;
+                        int k;
+                        for (k = 0; k < op->arity; ++k) {
+                            args[k].numerator = sp[k].num[j];
+                            args[k].denominator = sp[k].den[j];
+                        }
+                        r = call_op(op, args);
+                        if (op->arity == 0 && op->pure) {
+                            /* Without arguments a pure call is the same in every row. */
+                            fill_lanes(sp, r, len);
+                            break;
+                        }
+                        sp->num[j] = r.numerator;
+                        sp->den[j] = r.denominator;
+                    }
+                    break;
+            }
+        }
+
+        if (out_numerator) memcpy(out_numerator + row, sp->num, sizeof(long long) * len);
+        if (out_denominator) memcpy(out_denominator + row, sp->den, sizeof(long long) * len);
+    }
+
+    free(stack);
+    free(slot);
+    te_bytecode_free(b);
+    return 0;
+}
+
+
+/* Arbitrary precision evaluation. Values stay as a plain Rational while they
+ * fit; only an operation that overflows promotes its operands to limbs. */
+
+/* Natural number as little-endian 32-bit limbs; len 0 is zero. */
+typedef struct nat {
+    int len;
+    unsigned int *d;
+} nat;
+
+struct te_bignum {
+    int sign;       /* 1 or -1. */
+    nat num, den;   /* den > 0, gcd(num, den) = 1. */
+};
+
+static nat nat_alloc(int len) {
+    nat r;
+    r.len = len;
+    r.d = calloc(len ? len : 1, sizeof(unsigned int));
+    return r;
+}
+
+static void nat_trim(nat *a) {
+    while (a->len && !a->d[a->len - 1]) --a->len;
+}
+
+static nat nat_from(unsigned long long v) {
+    nat r = nat_alloc(2);
+    r.d[0] = (unsigned int)v;
+    r.d[1] = (unsigned int)(v >> 32);
+    nat_trim(&r);
+    return r;
+}
+
+static nat nat_copy(nat a) {
+    nat r = nat_alloc(a.len);
+    if (a.len) memcpy(r.d, a.d, sizeof(unsigned int) * a.len);
+    return r;
+}
+
+static int nat_cmp(nat a, nat b) {
+    int i;
+    if (a.len != b.len) return a.len < b.len ? -1 : 1;
+    for (i = a.len - 1; i >= 0; --i) {
+        if (a.d[i] != b.d[i]) return a.d[i] < b.d[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static nat nat_add(nat a, nat b) {
+    const int len = (a.len > b.len ? a.len : b.len) + 1;
+    nat r = nat_alloc(len);
+    unsigned long long carry = 0;
+    int i;
+    for (i = 0; i < len; ++i) {
+        carry += (unsigned long long)(i < a.len ? a.d[i] : 0) + (i < b.len ? b.d[i] : 0);
+        r.d[i] = (unsigned int)carry;
+        carry >>= 32;
+    }
+    nat_trim(&r);
+    return r;
+}
+
+/* a - b, requires a >= b. */
+static nat nat_sub(nat a, nat b) {
+    nat r = nat_alloc(a.len);
+    long long borrow = 0;
+    int i;
+    for (i = 0; i < a.len; ++i) {
+        long long t = (long long)a.d[i] - (i < b.len ? b.d[i] : 0) - borrow;
+        borrow = t < 0;
+        r.d[i] = (unsigned int)(t + (borrow << 32));
+    }
+    nat_trim(&r);
+    return r;
+}
+
+static nat nat_mul(nat a, nat b) {
+    nat r = nat_alloc(a.len + b.len);
+    int i, j;
+    for (i = 0; i < a.len; ++i) {
+        unsigned long long carry = 0;
+        for (j = 0; j < b.len; ++j) {
+            carry += (unsigned long long)a.d[i] * b.d[j] + r.d[i + j];
+            r.d[i + j] = (unsigned int)carry;
+            carry >>= 32;
+        }
+        r.d[i + b.len] = (unsigned int)carry;
+    }
+    nat_trim(&r);
+    return r;
+}
+
+static int nlz32(unsigned int x) {
+    int n = 0;
+    if (!x) return 32;
+    while (!(x & 0x80000000u)) {
+        x <<= 1;
+        ++n;
+    }
+    return n;
+}
+
+/* Schoolbook long division (Knuth 4.3.1 algorithm D). Either output may be NULL. */
+static void nat_divmod(nat u, nat v, nat *q, nat *r) {
+    const unsigned long long b = 1ULL << 32;
+    const int m = u.len, n = v.len;
+    nat qq, rr;
+    int i, j, s;
+
+    if (nat_cmp(u, v) < 0) {
+        if (q) *q = nat_alloc(0);
+        if (r) *r = nat_copy(u);
+        return;
+    }
+
+    qq = nat_alloc(m - n + 1);
+    rr = nat_alloc(n);
+
+    if (n == 1) {
+        unsigned long long k = 0;
+        for (j = m - 1; j >= 0; --j) {
+            const unsigned long long cur = k * b + u.d[j];
+            qq.d[j] = (unsigned int)(cur / v.d[0]);
+            k = cur - (unsigned long long)qq.d[j] * v.d[0];
+        }
+        rr.d[0] = (unsigned int)k;
+    } else {
+        /* Normalize so the divisor's top limb has its high bit set. */
+        unsigned int *un = calloc(m + 1, sizeof(unsigned int));
+        unsigned int *vn = calloc(n, sizeof(unsigned int));
+        s = nlz32(v.d[n - 1]);
+        for (i = n - 1; i > 0; --i) vn[i] = (v.d[i] << s) | (unsigned int)((unsigned long long)v.d[i - 1] >> (32 - s));
+        vn[0] = v.d[0] << s;
+        un[m] = (unsigned int)((unsigned long long)u.d[m - 1] >> (32 - s));
+        for (i = m - 1; i > 0; --i) un[i] = (u.d[i] << s) | (unsigned int)((unsigned long long)u.d[i - 1] >> (32 - s));
+        un[0] = u.d[0] << s;
+
+        for (j = m - n; j >= 0; --j) {
+            const unsigned long long top = (unsigned long long)un[j + n] * b + un[j + n - 1];
+            unsigned long long qhat = top / vn[n - 1];
+            unsigned long long rhat = top - qhat * vn[n - 1];
+            long long t, k;
+
+            while (qhat >= b || qhat * vn[n - 2] > b * rhat + un[j + n - 2]) {
+                --qhat;
+                rhat += vn[n - 1];
+                if (rhat >= b) break;
+            }
+
+            /* Multiply and subtract. */
+            k = 0;
+            for (i = 0; i < n; ++i) {
+                const unsigned long long p = qhat * vn[i];
+                t = (long long)un[i + j] - k - (long long)(p & 0xFFFFFFFFULL);
+                un[i + j] = (unsigned int)t;
+                k = (long long)(p >> 32) - (t >> 32);
+            }
+            t = (long long)un[j + n] - k;
+            un[j + n] = (unsigned int)t;
+
+            qq.d[j] = (unsigned int)qhat;
+            if (t < 0) {
+                /* Subtracted too much; add one divisor back. */
+                unsigned long long c = 0;
+                --qq.d[j];
+                for (i = 0; i < n; ++i) {
+                    c += (unsigned long long)un[i + j] + vn[i];
+                    un[i + j] = (unsigned int)c;
+                    c >>= 32;
+                }
+                un[j + n] += (unsigned int)c;
+            }
+        }
+
+        for (i = 0; i < n - 1; ++i) rr.d[i] = (un[i] >> s) | (unsigned int)((unsigned long long)un[i + 1] << (32 - s));
+        rr.d[n - 1] = un[n - 1] >> s;
+        free(un);
+        free(vn);
+    }
+
+    nat_trim(&qq);
+    nat_trim(&rr);
+    if (q) *q = qq; else free(qq.d);
+    if (r) *r = rr; else free(rr.d);
+}
+
+static nat nat_gcd(nat a, nat b) {
+    a = nat_copy(a);
+    b = nat_copy(b);
+    while (b.len) {
+        nat r;
+        nat_divmod(a, b, 0, &r);
+        free(a.d);
+        a = b;
+        b = r;
+    }
+    free(b.d);
+    return a;
+}
+
+/* Stores a in *out if it fits in 63 bits. */
+static int nat_small(nat a, long long *out) {
+    unsigned long long v;
+    if (a.len > 2) return 0;
+    v = a.len == 0 ? 0 : a.len == 1 ? a.d[0] : ((unsigned long long)a.d[1] << 32) | a.d[0];
+    if (v > LLONG_MAX) return 0;
+    *out = (long long)v;
+    return 1;
+}
+
+
+/* Takes ownership of num/den, reduces them, and demotes to a Rational if possible. */
+static te_big big_make(int sign, nat num, nat den) {
+    te_big r;
+    nat g = nat_gcd(num, den);
+    long long sn, sd;
+
+    if (!(g.len == 1 && g.d[0] == 1)) {
+        nat t;
+        nat_divmod(num, g, &t, 0); free(num.d); num = t;
+        nat_divmod(den, g, &t, 0); free(den.d); den = t;
+    }
+    free(g.d);
+
+    r.big = 0;
+    if (nat_small(num, &sn) && nat_small(den, &sd)) {
+        r.small.numerator = sign < 0 ? -sn : sn;
+        r.small.denominator = sd;
+        free(num.d);
+        free(den.d);
+        return r;
+    }
+
+    r.small = ROVERFLOW();
+    r.big = malloc(sizeof(struct te_bignum));
+    r.big->sign = num.len ? sign : 1;
+    r.big->num = num;
+    r.big->den = den;
+    return r;
+}
+
+/* Copies v into limbs. Small values must have a nonzero denominator. */
+static struct te_bignum big_unpack(const te_big *v) {
+    struct te_bignum q;
+    if (v->big) {
+        q.sign = v->big->sign;
+        q.num = nat_copy(v->big->num);
+        q.den = nat_copy(v->big->den);
+    } else {
+        q.sign = v->small.numerator < 0 ? -1 : 1;
+        q.num = nat_from(uabs(v->small.numerator));
+        q.den = nat_from(uabs(v->small.denominator));
+    }
+    return q;
+}
+
+static te_big big_small(Rational value) {
+    te_big r;
+    r.small = value;
+    r.big = 0;
+    return r;
+}
+
+static int big_valid(const te_big *v) {
+    return v->big || v->small.denominator != 0;
+}
+
+static te_big big_arith(Rational (*f)(Rational, Rational), const te_big *a, const te_big *b) {
+    struct te_bignum x, y;
+    nat num, den, l, r;
+    int sign;
+
+    if (!big_valid(a) || !big_valid(b)) return big_small(ROVERFLOW());
+    if (!a->big && !b->big) {
+        const Rational v = f(a->small, b->small);
+        if (v.denominator) return big_small(v);
+        if (f == divide && !b->small.numerator) return big_small(v);
+    }
+
+    x = big_unpack(a);
+    y = big_unpack(b);
+    if (f == divide) {
+        /* Multiply by the reciprocal. */
+        nat t = y.num;
+        if (!t.len) {
+            free(x.num.d); free(x.den.d); free(y.num.d); free(y.den.d);
+            return big_small(ROVERFLOW());
+        }
+        y.num = y.den;
+        y.den = t;
+        f = mul;
+    }
+
+    if (f == mul) {
+        num = nat_mul(x.num, y.num);
+        den = nat_mul(x.den, y.den);
+        sign = x.sign * y.sign;
+    } else {
+        const int ysign = f == sub ? -y.sign : y.sign;
+        l = nat_mul(x.num, y.den);
+        r = nat_mul(y.num, x.den);
+        den = nat_mul(x.den, y.den);
+        if (x.sign == ysign) {
+            num = nat_add(l, r);
+            sign = x.sign;
+        } else if (nat_cmp(l, r) >= 0) {
+            num = nat_sub(l, r);
+            sign = x.sign;
+        } else {
+            num = nat_sub(r, l);
+            sign = ysign;
+        }
+        free(l.d);
+        free(r.d);
+    }
+
+    free(x.num.d); free(x.den.d); free(y.num.d); free(y.den.d);
+    return big_make(sign, num, den);
+}
+
+
+/* Exact values of the prefixes that do not fit in 64 bits. */
+static const struct {const void *function; int exponent;} big_prefixes[] = {
+    {Y, 24}, {Z, 21}, {y, -24}, {z, -21}
+};
+
+static te_big big_pow10(int exponent) {
+    nat ten = nat_from(10), p = nat_from(1);
+    int i;
+    for (i = exponent < 0 ? -exponent : exponent; i > 0; --i) {
+        nat t = nat_mul(p, ten);
+        free(p.d);
+        p = t;
+    }
+    free(ten.d);
+    return exponent < 0 ? big_make(1, nat_from(1), p) : big_make(1, p, nat_from(1));
+}
+
+
+te_big te_eval_big(const te_expr *n) {
+    te_big args[7], ret;
+    const int arity = n ? ARITY(n->type) : 0;
+    int i;
+
+    if (!n) return big_small(RNAN());
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return big_small(n->value);
+        case TE_VARIABLE: return big_small(*n->bound);
+    }
+
+    if (IS_FUNCTION(n->type) && arity == 0) {
+        for (i = 0; i < (int)(sizeof(big_prefixes) / sizeof(big_prefixes[0])); ++i) {
+            if (big_prefixes[i].function == n->function) return big_pow10(big_prefixes[i].exponent);
+        }
+    }
+
+    for (i = 0; i < arity; ++i) {
+        args[i] = te_eval_big(n->parameters[i]);
+    }
+
+    if (IS_FUNCTION(n->type) && arity == 2 && (n->function == add || n->function == sub || n->function == mul || n->function == divide)) {
+        ret = big_arith((Rational(*)(Rational, Rational))n->function, &args[0], &args[1]);
+    } else if (IS_FUNCTION(n->type) && arity == 2 && n->function == comma) {
+        ret = args[1];
+        args[1].big = 0;
+    } else if (IS_FUNCTION(n->type) && arity == 1 && n->function == negate) {
+        ret = args[0];
+        args[0].big = 0;
+        if (ret.big) ret.big->sign = ret.big->num.len ? -ret.big->sign : 1;
+        else if (ret.small.numerator == LLONG_MIN) ret = big_make(1, nat_from(uabs(LLONG_MIN)), nat_from(uabs(ret.small.denominator)));
+        else ret.small = negate(ret.small);
+    } else if (IS_FUNCTION(n->type) && arity == 2 && n->function == tenpow && !args[1].big && args[1].small.denominator == 1
+            && args[1].small.numerator > -4096 && args[1].small.numerator < 4096) {
+        te_big scale = big_pow10((int)args[1].small.numerator);
+        ret = big_arith(mul, &args[0], &scale);
+        te_big_free(&scale);
+    } else {
+        /* Everything else runs on Rational arguments, so they must fit. */
+        Rational r[7];
+        int fits = 1;
+        for (i = 0; i < arity; ++i) {
+            fits = fits && !args[i].big;
+            r[i] = args[i].small;
+        }
+        if (!fits) {
+            ret = big_small(ROVERFLOW());
+        } else {
+            te_op op;
+            op.code = IS_CLOSURE(n->type) ? OP_CLOSURE : OP_FUNCTION;
+            op.arity = arity;
+            op.pure = 0;
+            op.function = n->function;
+            op.context = IS_CLOSURE(n->type) ? n->parameters[arity] : 0;
+            ret = big_small(call_op(&op, r));
+        }
+    }
+
+    for (i = 0; i < arity; ++i) {
+        te_big_free(&args[i]);
+    }
+    return ret;
+}
+
+
+
+/* Writes the digits of a into buf from the end backwards; returns the count. */
+static int nat_digits(nat a, char *buf, int size) {
+    nat t = nat_copy(a), ten9 = nat_from(1000000000);
+    int count = 0, i;
+    do {
+        nat q, r;
+        long long chunk = 0;
+        nat_divmod(t, ten9, &q, &r);
+        nat_small(r, &chunk);
+        free(t.d);
+        free(r.d);
+        t = q;
+        for (i = 0; i < 9 && (t.len || chunk || i == 0); ++i) {
+            if (count < size) buf[size - 1 - count] = (char)('0' + chunk % 10);
+            ++count;
+            chunk /= 10;
+        }
+    } while (t.len);
+    free(t.d);
+    free(ten9.d);
+    return count;
+}
+
+int te_big_format(const te_big *v, char *buf, int size) {
+    char *num, *den;
+    int nl, dl, numsize, densize, len = -1;
+
+    if (!v->big) return snprintf(buf, size, "%lld/%lld", v->small.numerator, v->small.denominator);
+
+    /* A 32-bit limb holds fewer than ten decimal digits. */
+    numsize = 10 * v->big->num.len + 1;
+    densize = 10 * v->big->den.len + 1;
+    num = malloc(numsize);
+    den = malloc(densize);
+    if (num && den) {
+        nl = nat_digits(v->big->num, num, numsize);
+        dl = nat_digits(v->big->den, den, densize);
+        len = snprintf(buf, size, "%s%.*s/%.*s", v->big->sign < 0 ? "-" : "",
+                nl, num + numsize - nl, dl, den + densize - dl);
+    }
+    free(num);
+    free(den);
+    return len;
+}
+
+void te_big_free(te_big *v) {
+    if (!v || !v->big) return;
+    free(v->big->num.d);
+    free(v->big->den.d);
+    free(v->big);
+    v->big = 0;
+}
+
+
 static void pn (const te_expr *n, int depth) {
     int i, arity;
     //printff("%*s", depth, "");